@@ -0,0 +1,1140 @@
+/*
+ * cache.c - main memory cache of web objects
+ *
+ * The cache is CACHE_SHARDS shards picked by the top bits of a 64-bit
+ * hash of hostname + path. Each shard has its own writer lock, chained
+ * hash index and LRU list.
+ *
+ * Lookups take no lock. A reader enters an epoch, walks the bucket chain,
+ * takes a reference on the object and leaves the epoch again, so
+ * the (possibly slow) write to the client happens outside both any lock
+ * and the epoch; release_cache drops the reference. Writers
+ * publish bucket and chain pointers with release stores and unlink
+ * objects without touching their next_hash, so a reader standing on a
+ * removed object can still finish its walk. Removed objects and old
+ * bucket arrays are retired and only freed once no reader that might
+ * still see them is left (see the Epoch Functions below); a retired
+ * object then drops the index's reference on itself.
+ *
+ * Which object makes room for a new one is up to the replacement policy
+ * (policy.c), selected once at startup with set_cache_policy. Objects
+ * past their expiry (plus their grace) do not wait for it: each shard
+ * files them in a hierarchical timing wheel by deadline, and a
+ * maintenance thread removes them as their second comes up.
+ *
+ * The same thread does the inserting: commit_cache only queues the new
+ * object on its shard, so the client that fetched it never waits for
+ * eviction. Between ticks the thread also evicts each shard down to
+ * SHARD_RESERVE bytes below capacity, so most inserts find room ready.
+ *
+ * With a disk tier (disk.c) behind it, evicted objects are queued for
+ * the maintenance thread to write there, outside any shard lock, and a
+ * lookup that misses in memory brings the object back from disk.
+ * Objects too big for memory go to the disk tier only.
+ *
+ * save_cache writes the whole cache to a snapshot file and load_cache
+ * inserts a snapshot's objects again, so a restarted proxy starts warm.
+ */
+#include "cache.h"
+
+size_t cache_size = 0;				/* bytes across all shards */
+long cache_grace = 0;				/* seconds stale objects stay for stale serving */
+int cache_memfd = 0;				/* keep objects in a memfd, for sendfile (slab_file) */
+cache_policy *policy = &lru_policy;
+
+static cache_shard shards[CACHE_SHARDS];
+
+static unsigned long global_epoch = 1;
+static epoch_record *epoch_records;	/* grows only, records are reused */
+static pthread_key_t epoch_key;		/* releases a thread's record at exit */
+static __thread epoch_record *my_record;
+static retired *retired_list;
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_mutex_t maintain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t maintain_cond = PTHREAD_COND_INITIALIZER;
+static int maintain_work;			/* inserts were queued since the last pass */
+static int maintain_settle;			/* settle_cache wants a full pass now */
+static unsigned long maintain_settled;	/* full passes made for settle_cache */
+static pthread_cond_t settled_cond = PTHREAD_COND_INITIALIZER;
+static cache_line *demoted;			/* evicted, waiting for the disk tier (LIFO) */
+
+static cache_shard *shard_of(unsigned long long);
+static cache_line *lookup(cache_shard*, unsigned long long, char*, char*);
+static cache_line *create_cache(char*, char*, unsigned long long, size_t);
+static void free_cache(void*);
+static void unlink_cache(cache_shard*, cache_line*);
+static cache_line *promote(char*, char*, unsigned long long);
+static void demote_queued();
+static void render_cache(cache_line*);
+static long directive_grace(char*, char*);
+static int hop_by_hop(char*, size_t, char*, size_t);
+static int write_snapshot(FILE*, cache_line*);
+static void evict_object(void*);
+static cache_index *new_index(size_t);
+static void index_insert(cache_shard*, cache_line*);
+static void index_remove(cache_shard*, cache_line*);
+static void index_grow(cache_shard*);
+static time_t wheel_deadline(cache_line*);
+static void wheel_insert(cache_shard*, cache_line*);
+static void wheel_unlink(cache_line*);
+static void wheel_cascade(cache_shard*, int);
+static void expire_shard(cache_shard*, time_t);
+static int publish(cache_shard*, cache_line*);
+static void publish_shard(cache_shard*);
+static void reserve_shard(cache_shard*);
+static void *maintain_cache(void*);
+static void epoch_enter();
+static void epoch_leave();
+static void epoch_release(void*);
+static void retire(void*, void (*)(void*));
+static void reclaim();
+
+/*
+ * hash_key - FNV-1a over the normalized key: the hostname lowercased
+ * (hosts are case-insensitive), a NUL separator, then the path.
+ */
+unsigned long long hash_key(char *hostname, char *path)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	char *c;
+
+	for (c = hostname; *c; c++) {
+		hash ^= (unsigned char)tolower((unsigned char)*c);
+		hash *= 1099511628211ULL;
+	}
+	hash *= 1099511628211ULL;		/* the separator */
+	for (c = path; *c; c++) {
+		hash ^= (unsigned char)*c;
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+/* set_cache_policy - choose the replacement policy before initialize_cache */
+int set_cache_policy(char *name)
+{
+	cache_policy *policies[] = { &lru_policy, &clock_policy, &tinylfu_policy,
+		&gdsf_policy, &gdsf_bytes_policy, NULL };
+	int i;
+
+	for (i = 0; policies[i]; i++)
+		if (strcmp(policies[i]->name, name) == 0) {
+			policy = policies[i];
+			return 0;
+		}
+	return -1;
+}
+
+void initialize_cache() 
+{
+	pthread_t tid;
+	int i;
+
+	printf("initializing cache\n");
+	pthread_key_create(&epoch_key, epoch_release);
+	slab_init(CACHE_ARENA_SIZE, evict_object, cache_memfd);
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard *shard = &shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		pthread_mutex_init(&shard->lru_lock, NULL);
+		shard->root.size = shard->root.charge = 0;
+		shard->root.next_line = &shard->root;
+		shard->root.prev_line = &shard->root;
+
+		shard->index = new_index(CACHE_MIN_BUCKETS);
+		shard->count = 0;
+		shard->size = 0;
+		memset(shard->wheel, 0, sizeof(shard->wheel));
+		shard->wheel_time = time(NULL);
+		shard->pending = NULL;
+		if (policy->init)
+			policy->init(shard);
+	}
+	Pthread_create(&tid, NULL, maintain_cache, NULL);
+}
+
+/*
+ * search_cache - look up an object without locking and return it with a
+ * reference held. The epoch only covers the lookup: the index's own
+ * reference cannot be dropped before the epoch ends, so the object is
+ * still live when the reader takes its reference.
+ */
+cache_line* search_cache(char *path, char *hostname)
+{
+	unsigned long long hash = hash_key(hostname, path);
+	cache_shard *shard = shard_of(hash);
+	cache_line *line;
+
+	epoch_enter();
+	if ((line = lookup(shard, hash, hostname, path))) {
+		__atomic_add_fetch(&line->refcnt, 1, __ATOMIC_RELAXED);
+		policy->hit(shard, line);
+	}
+	epoch_leave();
+	if (!line && disk_active)
+		line = promote(hostname, path, hash);
+	return line;
+}
+
+/*
+ * peek_cache - look up an object in memory like search_cache, but without
+ * counting it as a hit or promoting a disk copy: for callers that only
+ * want to know what a request would find. The reference is released with
+ * release_cache as usual.
+ */
+cache_line* peek_cache(char *path, char *hostname)
+{
+	unsigned long long hash = hash_key(hostname, path);
+	cache_line *line;
+
+	epoch_enter();
+	if ((line = lookup(shard_of(hash), hash, hostname, path)))
+		__atomic_add_fetch(&line->refcnt, 1, __ATOMIC_RELAXED);
+	epoch_leave();
+	return line;
+}
+
+/*
+ * fresh_cache - whether an object may still be served without asking the
+ * origin, or with grace > 0 whether it went stale less than grace seconds ago
+ */
+int fresh_cache(cache_line *line, long grace)
+{
+	return time(NULL) < __atomic_load_n(&line->expires, __ATOMIC_RELAXED) + grace;
+}
+
+/*
+ * refresh_cache - move the freshness deadline of an object the origin has
+ * just confirmed (304 Not Modified), which also makes it new again for
+ * Age; the response itself stays as it is.
+ */
+void refresh_cache(cache_line *line, time_t expires)
+{
+	__atomic_store_n(&line->expires, expires, __ATOMIC_RELAXED);
+	__atomic_store_n(&line->fetched, time(NULL), __ATOMIC_RELAXED);
+}
+
+/* start_refresh - claim the one background revalidation of an object */
+int start_refresh(cache_line *line)
+{
+	return __atomic_exchange_n(&line->refreshing, 1, __ATOMIC_ACQ_REL) == 0;
+}
+
+void end_refresh(cache_line *line)
+{
+	__atomic_store_n(&line->refreshing, 0, __ATOMIC_RELEASE);
+}
+
+/* release_cache - drop a reference taken by search_cache or peek_cache */
+void release_cache(cache_line *line)
+{
+	free_cache(line);
+}
+
+/*
+ * reserve_cache - allocate an unpublished entry of size body bytes, fresh
+ * until expires, for the caller to fill in place through cache_data.
+ * Returns NULL if the object is too big or its size class is full and
+ * being rebalanced. The entry must be handed to commit_cache or
+ * abandon_cache.
+ */
+cache_line *reserve_cache(char *hostname, char *path, size_t size, time_t expires)
+{
+	cache_line *new_line;
+
+	if (size > MAX_OBJECT_SIZE)
+		return NULL;
+	reclaim();		/* hand retired chunks back to the slab first */
+	if ((new_line = create_cache(hostname, path, hash_key(hostname, path), size)))
+		new_line->expires = expires;
+	return new_line;
+}
+
+/*
+ * commit_cache - render a filled reservation's headers and hand it to the
+ * maintenance thread, which inserts it shortly (see publish); the caller
+ * is done with it.
+ */
+void commit_cache(cache_line *new_line)
+{
+	cache_shard *shard = shard_of(new_line->hash);
+
+	render_cache(new_line);
+
+	new_line->next_hash = __atomic_load_n(&shard->pending, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&shard->pending, &new_line->next_hash, new_line, 0,
+		__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	pthread_mutex_lock(&maintain_lock);
+	maintain_work = 1;
+	pthread_cond_signal(&maintain_cond);
+	pthread_mutex_unlock(&maintain_lock);
+}
+
+/*
+ * settle_cache - wait for a full maintenance pass that starts after the
+ * call: everything committed so far is inserted, expired objects are
+ * gone and every shard is back down to its reserve. For benchmarks,
+ * which commit faster than the ticks would keep up with.
+ */
+void settle_cache()
+{
+	unsigned long settled;
+
+	pthread_mutex_lock(&maintain_lock);
+	settled = maintain_settled;
+	maintain_work = maintain_settle = 1;
+	pthread_cond_signal(&maintain_cond);
+	while (maintain_settled == settled)
+		pthread_cond_wait(&settled_cond, &maintain_lock);
+	pthread_mutex_unlock(&maintain_lock);
+}
+
+/* abandon_cache - drop a reservation that was never filled completely */
+void abandon_cache(cache_line *line)
+{
+	free_cache(line);
+}
+
+/*
+ * insert_cache - copy a complete response into the cache, or straight
+ * into the disk tier if memory has no room for it (too big, or its size
+ * class is full)
+ */
+void insert_cache(char *hostname, char *path, char *data, size_t size, time_t expires)
+{
+	cache_line *new_line = reserve_cache(hostname, path, size, expires);
+
+	if (!new_line) {
+		if (disk_active)
+			disk_store(hostname, path, hash_key(hostname, path), data, size, expires, time(NULL));
+		return;
+	}
+	memcpy(cache_data(new_line), data, size);
+	commit_cache(new_line);
+}
+
+/* destruct_cache - free everything; no other thread may be using the cache */
+void destruct_cache()
+{
+	cache_line *temp, *next;
+	retired *r, *next_r;
+	size_t b;
+	int i;
+
+	for (i = 0; i < CACHE_SHARDS; i++) {
+		cache_shard *shard = &shards[i];
+
+		for (b = 0; b < shard->index->buckets; b++)
+			for (temp = shard->index->head[b]; temp; temp = next) {
+				next = temp->next_hash;
+				free_cache(temp);
+			}
+		for (temp = shard->pending; temp; temp = next) {
+			next = temp->next_hash;
+			free_cache(temp);
+		}
+		shard->pending = NULL;
+		Free(shard->index);
+		shard->index = NULL;
+		shard->count = shard->size = 0;
+		pthread_mutex_destroy(&shard->lock);
+		pthread_mutex_destroy(&shard->lru_lock);
+	}
+	for (temp = demoted; temp; temp = next) {
+		next = temp->wheel_next;
+		free_cache(temp);
+	}
+	demoted = NULL;
+	for (r = retired_list; r; r = next_r) {
+		next_r = r->next_retired;
+		r->destroy(r->ptr);
+		Free(r);
+	}
+	retired_list = NULL;
+	cache_size = 0;
+}
+
+/* Shard Functions (writers hold the shard lock) */
+static cache_shard *shard_of(unsigned long long hash)
+{
+	return &shards[(hash >> 56) % CACHE_SHARDS];	/* buckets use the low bits */
+}
+
+/*
+ * lookup - full key comparison only on a 64-bit hash match. Safe without
+ * the shard lock inside an epoch; a reader racing with index_grow may
+ * miss an object, which only costs an origin fetch.
+ */
+static cache_line *lookup(cache_shard *shard, unsigned long long hash, char *hostname, char *path)
+{
+	cache_index *index = __atomic_load_n(&shard->index, __ATOMIC_ACQUIRE);
+	cache_line* temp = __atomic_load_n(&index->head[hash & (index->buckets - 1)], __ATOMIC_ACQUIRE);
+
+	while(temp != NULL) {
+		if (temp->hash == hash && strcmp(path, cache_path(temp)) == 0
+			&& strcasecmp(hostname, cache_host(temp)) == 0)
+			return temp;
+		temp = __atomic_load_n(&temp->next_hash, __ATOMIC_ACQUIRE);
+	}
+	return NULL;
+}
+
+/*
+ * create_cache - build an entry in one slab chunk with the key inline
+ * after the header and room for the body after that. Returns NULL if the
+ * slab has no chunk for it.
+ */
+static cache_line *create_cache(char *hostname, char *path, unsigned long long hash, size_t size)
+{
+	size_t host_len = strlen(hostname), key_len = host_len + strlen(path) + 2;
+	cache_line *new_line = slab_alloc(sizeof(cache_line) + key_len + size);
+
+	if (!new_line)
+		return NULL;
+	printf("creating a new cache item\n");
+	new_line->refcnt = 1;			/* the index's reference */
+	new_line->key_len = key_len;
+	new_line->host_len = host_len;
+	new_line->size = size;
+	new_line->charge = slab_chunk_size(new_line);	/* what the slab really used */
+	new_line->hash = hash;
+	new_line->head_off = new_line->head_len = 0;
+	new_line->fetched = 0;			/* from the response's Age, see render_cache */
+	new_line->grace = cache_grace;	/* or its own, see render_cache */
+	new_line->refreshing = 0;
+	new_line->on_disk = 0;
+	new_line->unlinked = 0;
+	new_line->referenced = 0;
+	new_line->wheel_pprev = NULL;
+	memcpy(cache_host(new_line), hostname, host_len + 1);
+	strcpy(cache_path(new_line), path);
+
+	return new_line;
+}
+
+/*
+ * remove_cache - evict an object. With a disk tier it is queued to be
+ * written there (unless it came from there), on a reference of its own.
+ */
+void remove_cache(cache_shard *shard, cache_line *target)
+{
+	int demote = disk_active && !target->on_disk;
+
+	if (demote)
+		__atomic_add_fetch(&target->refcnt, 1, __ATOMIC_RELAXED);
+	unlink_cache(shard, target);
+	if (demote) {
+		target->wheel_next = __atomic_load_n(&demoted, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&demoted, &target->wheel_next, target, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+}
+
+/* unlink_cache - remove an object; readers may still hold it, so retire it */
+static void unlink_cache(cache_shard *shard, cache_line *target)
+{
+	policy->remove(shard, target);
+	index_remove(shard, target);
+	wheel_unlink(target);
+	shard->size -= target->charge;
+	__atomic_sub_fetch(&cache_size, target->charge, __ATOMIC_RELAXED);
+	retire(target, free_cache);
+}
+
+/* free_cache - drop one reference; the last one hands the chunk back */
+static void free_cache(void *ptr)
+{
+	cache_line *line = ptr;
+
+	if (__atomic_sub_fetch(&line->refcnt, 1, __ATOMIC_ACQ_REL) == 0)
+		slab_free(line);
+}
+
+/*
+ * evict_object - slab callback for a chunk on a page being drained. The
+ * chunk may already have been freed, so its hash is trusted only if the
+ * chunk itself is still in the index under it.
+ */
+static void evict_object(void *chunk)
+{
+	unsigned long long hash = ((cache_line*)chunk)->hash;
+	cache_shard *shard = shard_of(hash);
+	cache_line *line;
+
+	pthread_mutex_lock(&shard->lock);
+	for (line = shard->index->head[hash & (shard->index->buckets - 1)]; line; line = line->next_hash)
+		if (line == chunk) {
+			remove_cache(shard, line);
+			break;
+		}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Hash Index Functions */
+static cache_index *new_index(size_t buckets)
+{
+	cache_index *index = Calloc(1, sizeof(cache_index) + buckets * sizeof(cache_line*));
+
+	index->buckets = buckets;
+	return index;
+}
+
+static void index_insert(cache_shard *shard, cache_line *line)
+{
+	cache_line **head;
+
+	if (shard->count >= shard->index->buckets)	/* keep chains at ~1 entry */
+		index_grow(shard);
+	head = &shard->index->head[line->hash & (shard->index->buckets - 1)];
+	line->next_hash = *head;
+	__atomic_store_n(head, line, __ATOMIC_RELEASE);
+	shard->count++;
+}
+
+/* index_remove - the removed object keeps its next_hash for readers on it */
+static void index_remove(cache_shard *shard, cache_line *line)
+{
+	cache_line **link = &shard->index->head[line->hash & (shard->index->buckets - 1)];
+
+	while (*link && *link != line)
+		link = &(*link)->next_hash;
+	if (*link) {
+		__atomic_store_n(link, line->next_hash, __ATOMIC_RELEASE);
+		shard->count--;
+	}
+}
+
+static void index_grow(cache_shard *shard)
+{
+	cache_index *old = shard->index;
+	cache_index *index = new_index(old->buckets * 2);
+	cache_line *line, *next;
+	size_t i;
+
+	for (i = 0; i < old->buckets; i++)
+		for (line = old->head[i]; line; line = next) {
+			next = line->next_hash;
+			line->next_hash = index->head[line->hash & (index->buckets - 1)];
+			index->head[line->hash & (index->buckets - 1)] = line;
+		}
+	__atomic_store_n(&shard->index, index, __ATOMIC_RELEASE);
+	retire(old, free);
+}
+
+/* Timing Wheel Functions (writers hold the shard lock) */
+static time_t wheel_deadline(cache_line *line)
+{
+	return __atomic_load_n(&line->expires, __ATOMIC_RELAXED) + line->grace;
+}
+
+/*
+ * wheel_insert - file an object by deadline: level 0 if it is due within
+ * WHEEL_SLOTS seconds, else the coarsest level that still tells it apart
+ * from now. Deadlines beyond the top level wait in its furthest slot and
+ * are filed again when that slot comes up.
+ */
+static void wheel_insert(cache_shard *shard, cache_line *line)
+{
+	time_t now = shard->wheel_time, deadline = wheel_deadline(line);
+	cache_line **slot;
+	int level;
+
+	if (deadline < now)
+		deadline = now;
+	if (deadline - now >= (time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+		deadline = now + ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+		if (deadline - now < (time_t)1 << (WHEEL_BITS * (level + 1)))
+			break;
+	slot = &shard->wheel[level][(deadline >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+
+	line->wheel_next = *slot;
+	if (*slot)
+		(*slot)->wheel_pprev = &line->wheel_next;
+	line->wheel_pprev = slot;
+	*slot = line;
+}
+
+static void wheel_unlink(cache_line *line)
+{
+	if (!line->wheel_pprev)
+		return;
+	*line->wheel_pprev = line->wheel_next;
+	if (line->wheel_next)
+		line->wheel_next->wheel_pprev = line->wheel_pprev;
+	line->wheel_pprev = NULL;
+}
+
+/* wheel_cascade - refile the level's slot that the current second opens */
+static void wheel_cascade(cache_shard *shard, int level)
+{
+	cache_line **slot = &shard->wheel[level][(shard->wheel_time >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+	cache_line *line;
+
+	while ((line = *slot)) {
+		wheel_unlink(line);
+		wheel_insert(shard, line);
+	}
+}
+
+/*
+ * expire_shard - run the shard's wheel up to now. Objects whose deadline
+ * has passed are removed EXPIRE_BATCH at a time, letting writers in
+ * between batches; ones refreshed since they were filed are filed again.
+ */
+static void expire_shard(cache_shard *shard, time_t now)
+{
+	cache_line **slot, *line;
+	int level, n;
+
+	pthread_mutex_lock(&shard->lock);
+	while (shard->wheel_time <= now) {
+		for (level = WHEEL_LEVELS - 1; level > 0; level--)
+			if ((shard->wheel_time & (((time_t)1 << (WHEEL_BITS * level)) - 1)) == 0)
+				wheel_cascade(shard, level);
+
+		slot = &shard->wheel[0][shard->wheel_time & (WHEEL_SLOTS - 1)];
+		for (n = 0; (line = *slot) && n < EXPIRE_BATCH; n++) {
+			wheel_unlink(line);
+			if (wheel_deadline(line) > shard->wheel_time)
+				wheel_insert(shard, line);
+			else
+				unlink_cache(shard, line);
+		}
+		if (*slot) {			/* more due this second: let writers in first */
+			pthread_mutex_unlock(&shard->lock);
+			pthread_mutex_lock(&shard->lock);
+			continue;
+		}
+		shard->wheel_time++;
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/* Maintenance Functions */
+
+/*
+ * publish - insert a committed object (shard lock held), evicting as the
+ * policy decides and replacing any copy under the same key (which is not
+ * demoted: it is outdated). Returns 0 if
+ * the policy left it out; it was never visible then.
+ */
+static int publish(cache_shard *shard, cache_line *new_line)
+{
+	cache_line *old;
+
+	if ((old = lookup(shard, new_line->hash, cache_host(new_line), cache_path(new_line))))
+		unlink_cache(shard, old);
+	if (!policy->insert(shard, new_line))
+		return 0;
+	if (disk_active && !new_line->on_disk)	/* a new copy outdates the disk tier's */
+		disk_forget(cache_host(new_line), cache_path(new_line), new_line->hash);
+	index_insert(shard, new_line);		/* publish last, fully built */
+	wheel_insert(shard, new_line);
+	shard->size += new_line->charge;
+	__atomic_add_fetch(&cache_size, new_line->charge, __ATOMIC_RELAXED);
+	return 1;
+}
+
+/* publish_shard - insert the shard's queued objects in commit order */
+static void publish_shard(cache_shard *shard)
+{
+	cache_line *queue = __atomic_exchange_n(&shard->pending, NULL, __ATOMIC_ACQUIRE);
+	cache_line *fifo = NULL, *rejected = NULL, *line;
+	int n;
+
+	while ((line = queue)) {
+		queue = line->next_hash;
+		line->next_hash = fifo;
+		fifo = line;
+	}
+	while (fifo) {
+		pthread_mutex_lock(&shard->lock);
+		for (n = 0; (line = fifo) && n < EXPIRE_BATCH; n++) {
+			fifo = line->next_hash;
+			if (!publish(shard, line)) {
+				line->next_hash = rejected;
+				rejected = line;
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	while ((line = rejected)) {
+		rejected = line->next_hash;
+		free_cache(line);
+	}
+}
+
+/* reserve_shard - evict ahead of demand until SHARD_RESERVE bytes are free */
+static void reserve_shard(cache_shard *shard)
+{
+	int n, more = 1;
+
+	while (more) {
+		pthread_mutex_lock(&shard->lock);
+		for (n = 0; n < EXPIRE_BATCH; n++)
+			if (!(more = shard->size > SHARD_CAPACITY - SHARD_RESERVE && policy->evict(shard)))
+				break;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+/*
+ * maintain_cache - background thread: insert committed objects as soon
+ * as they are queued, and every CACHE_TICK_MS expire objects, restore the
+ * free-space reserve and flush the disk tier's write buffer; evicted
+ * objects go to the disk tier and retired ones are freed after each pass
+ */
+static void *maintain_cache(void *vargp)
+{
+	struct timespec tick, now;
+	int i, settle;
+
+	Pthread_detach(pthread_self());
+	clock_gettime(CLOCK_REALTIME, &tick);
+	while (1) {
+		pthread_mutex_lock(&maintain_lock);
+		while (!maintain_work && pthread_cond_timedwait(&maintain_cond, &maintain_lock, &tick) == 0)
+			;
+		maintain_work = 0;
+		settle = maintain_settle;
+		maintain_settle = 0;
+		pthread_mutex_unlock(&maintain_lock);
+
+		for (i = 0; i < CACHE_SHARDS; i++)
+			publish_shard(&shards[i]);
+		demote_queued();
+		reclaim();
+
+		clock_gettime(CLOCK_REALTIME, &now);
+		if (!settle && (now.tv_sec < tick.tv_sec
+			|| (now.tv_sec == tick.tv_sec && now.tv_nsec < tick.tv_nsec)))
+			continue;
+		for (i = 0; i < CACHE_SHARDS; i++) {
+			expire_shard(&shards[i], now.tv_sec);
+			reserve_shard(&shards[i]);
+		}
+		demote_queued();
+		disk_flush();
+		reclaim();
+		tick.tv_nsec = now.tv_nsec + CACHE_TICK_MS * 1000000L;
+		tick.tv_sec = now.tv_sec + tick.tv_nsec / 1000000000L;
+		tick.tv_nsec %= 1000000000L;
+		if (settle) {
+			pthread_mutex_lock(&maintain_lock);
+			maintain_settled++;
+			pthread_cond_broadcast(&settled_cond);
+			pthread_mutex_unlock(&maintain_lock);
+		}
+	}
+	return NULL;
+}
+
+/* Disk Tier Functions */
+
+/*
+ * promote - bring an object back from the disk tier into a reservation
+ * that is committed like a fetched one, with the caller's reference
+ * already on it. Objects too big for memory stay on disk for the caller.
+ */
+static cache_line *promote(char *hostname, char *path, unsigned long long hash)
+{
+	cache_line *line = NULL;
+	disk_object obj;
+
+	if (!disk_open(hostname, path, hash, &obj))
+		return NULL;
+	if ((line = reserve_cache(hostname, path, obj.size, obj.expires))) {
+		if (disk_read(&obj, cache_data(line), obj.size, 0) == (ssize_t)obj.size) {
+			line->on_disk = 1;
+			line->fetched = obj.fetched;
+			line->refcnt++;			/* the caller's; the index takes the first */
+			commit_cache(line);
+		} else {
+			abandon_cache(line);
+			line = NULL;
+		}
+	}
+	disk_close(&obj);
+	return line;
+}
+
+/* demote_queued - write evicted objects to the disk tier, unless long expired */
+static void demote_queued()
+{
+	cache_line *queue = __atomic_exchange_n(&demoted, NULL, __ATOMIC_ACQUIRE), *line;
+
+	while ((line = queue)) {
+		queue = line->wheel_next;
+		if (fresh_cache(line, line->grace))
+			disk_store(cache_host(line), cache_path(line), line->hash, cache_response(line),
+				cache_response_size(line), line->expires, line->fetched);
+		free_cache(line);
+	}
+}
+
+/* Header Rendering Functions */
+
+/*
+ * render_cache - pre-render a new entry's headers for hits: drop the
+ * hop-by-hop ones (the standard ones and any its Connection header names)
+ * and Age, which serve_cache adds per hit, then move the remaining lines
+ * up against the blank line so the response stays contiguous from
+ * head_off. The Age dropped dates fetched unless the entry already has a
+ * date, and a stale-while-revalidate or stale-if-error longer than
+ * cache_grace becomes the entry's grace. A response without a complete
+ * header block is left as it is.
+ */
+static void render_cache(cache_line *line)
+{
+	char *data = cache_data(line), *end = data + line->size, *p, *eol, *colon;
+	char *connection = NULL, *kept, *out;
+	size_t conn_len = 0, head;
+	long age = 0, grace;
+	int drop = 0;
+
+	for (p = data; p + 1 < end && !(p[0] == '\r' && p[1] == '\n'); p = eol + 2) {
+		for (eol = p; eol + 1 < end && !(eol[0] == '\r' && eol[1] == '\n'); eol++)
+			;
+		if (eol + 1 >= end)
+			return;			/* the header block never ends */
+		if (p != data && strncasecmp(p, "Connection:", 11) == 0) {
+			connection = p + 11;
+			conn_len = eol - connection;
+		}
+	}
+	if (p + 1 >= end || p == data)
+		return;
+	head = p - data;		/* through the last header line's CRLF */
+
+	kept = out = Malloc(head);
+	for (p = data; p < data + head; p = eol + 2) {
+		for (eol = p; !(eol[0] == '\r' && eol[1] == '\n'); eol++)
+			;
+		if (p != data && *p != ' ' && *p != '\t') {	/* not the status line or a continuation */
+			if (!(colon = memchr(p, ':', eol - p)))
+				colon = eol;
+			drop = hop_by_hop(p, colon - p, connection, conn_len);
+			if (colon - p == 3 && strncasecmp(p, "Age", 3) == 0) {
+				age = atol(colon + 1);
+				drop = 1;
+			} else if (colon - p == 13 && strncasecmp(p, "Cache-Control", 13) == 0
+				&& (grace = directive_grace(colon, eol)) > line->grace)
+				line->grace = grace;
+		}
+		if (!drop) {
+			memcpy(out, p, eol + 2 - p);
+			out += eol + 2 - p;
+		}
+	}
+	line->head_off = head - (out - kept);
+	line->head_len = out - kept;
+	memcpy(data + line->head_off, kept, line->head_len);
+	Free(kept);
+	if (!line->fetched)
+		line->fetched = time(NULL) - (age > 0 ? age : 0);
+}
+
+/*
+ * directive_grace - the longer of the stale-while-revalidate and
+ * stale-if-error directives in a Cache-Control value, 0 if it has neither
+ */
+static long directive_grace(char *value, char *end)
+{
+	long grace = 0, secs;
+	char *p;
+
+	for (p = value; p < end; p++) {
+		if (end - p > 23 && strncasecmp(p, "stale-while-revalidate=", 23) == 0)
+			secs = atol(p + 23);
+		else if (end - p > 15 && strncasecmp(p, "stale-if-error=", 15) == 0)
+			secs = atol(p + 15);
+		else
+			continue;
+		if (secs > grace)
+			grace = secs;
+	}
+	return grace;
+}
+
+/* hop_by_hop - whether a header is only meant for the next hop */
+static int hop_by_hop(char *name, size_t len, char *connection, size_t conn_len)
+{
+	static char *always[] = { "Connection", "Keep-Alive", "Proxy-Connection",
+		"Proxy-Authenticate", "Proxy-Authorization", "TE", "Trailer", "Upgrade", NULL };
+	char *token, *end = connection + conn_len;
+	int i;
+
+	for (i = 0; always[i]; i++)
+		if (strlen(always[i]) == len && strncasecmp(name, always[i], len) == 0)
+			return 1;
+	while (connection && connection < end) {	/* comma-separated header names */
+		while (connection < end && (*connection == ' ' || *connection == '\t' || *connection == ','))
+			connection++;
+		for (token = connection; connection < end && *connection != ','
+			&& *connection != ' ' && *connection != '\t'; connection++)
+			;
+		if ((size_t)(connection - token) == len && strncasecmp(name, token, len) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* Snapshot Functions */
+
+/*
+ * save_cache - write every object not long expired to file (see
+ * snapshot_header). A shard's objects are gathered under its lock with a
+ * reference each and written after it is let go; the new snapshot only
+ * replaces the old one once it is complete and synced. Returns the
+ * objects written, or -1 on error.
+ */
+int save_cache(char *file)
+{
+	static pthread_mutex_t snapshot_lock = PTHREAD_MUTEX_INITIALIZER;
+	char tmp[MAXLINE];
+	snapshot_header header;
+	cache_line **lines = NULL, *line;
+	size_t cap = 0, n, j, b;
+	FILE *fp;
+	int i, ok;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", file);
+	pthread_mutex_lock(&snapshot_lock);
+	if (!(fp = fopen(tmp, "w"))) {
+		pthread_mutex_unlock(&snapshot_lock);
+		return -1;
+	}
+	header.magic = SNAPSHOT_MAGIC;
+	header.version = SNAPSHOT_VERSION;
+	header.count = 0;
+	ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+
+	for (i = 0; i < CACHE_SHARDS && ok; i++) {
+		cache_shard *shard = &shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		if (cap < shard->count) {
+			cap = shard->count;
+			lines = Realloc(lines, cap * sizeof(cache_line*));
+		}
+		for (n = 0, b = 0; b < shard->index->buckets; b++)
+			for (line = shard->index->head[b]; line; line = line->next_hash) {
+				__atomic_add_fetch(&line->refcnt, 1, __ATOMIC_RELAXED);
+				lines[n++] = line;
+			}
+		pthread_mutex_unlock(&shard->lock);
+
+		for (j = 0; j < n; j++) {
+			if (ok && fresh_cache(lines[j], lines[j]->grace)) {
+				ok = write_snapshot(fp, lines[j]);
+				header.count++;
+			}
+			free_cache(lines[j]);
+		}
+	}
+	free(lines);
+
+	ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, fp) == 1
+		&& fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+	if (fclose(fp) != 0)
+		ok = 0;
+	if (ok && rename(tmp, file) < 0)
+		ok = 0;
+	if (!ok)
+		unlink(tmp);
+	pthread_mutex_unlock(&snapshot_lock);
+	return ok ? (int)header.count : -1;
+}
+
+/*
+ * load_cache - insert the objects of a snapshot written by save_cache,
+ * mapping the file rather than reading it and skipping objects expired
+ * beyond their grace. A damaged record ends the load. Returns the
+ * objects loaded, or -1 if file is missing or not a snapshot.
+ */
+int load_cache(char *file)
+{
+	snapshot_header *header;
+	snapshot_record *rec;
+	struct stat st;
+	char *map, *p, *end, *key;
+	unsigned long long i;
+	time_t now = time(NULL);
+	cache_line *line;
+	size_t left;
+	int fd, loaded = 0;
+
+	if ((fd = open(file, O_RDONLY)) < 0)
+		return -1;
+	if (fstat(fd, &st) < 0 || st.st_size < sizeof(snapshot_header)
+		|| (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	header = (snapshot_header*)map;
+	if (header->magic != SNAPSHOT_MAGIC || header->version != SNAPSHOT_VERSION) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	end = map + st.st_size;
+	for (i = 0, p = map + sizeof(snapshot_header); i < header->count; i++) {
+		if (p > end || (size_t)(end - p) < sizeof(snapshot_record))
+			break;
+		rec = (snapshot_record*)p;
+		key = p + sizeof(snapshot_record);
+		left = end - key;
+		if (rec->key_len > left || rec->size > left - rec->key_len || rec->key_len < 2
+			|| rec->host_len > rec->key_len - 2 || key[rec->host_len] || key[rec->key_len - 1])
+			break;
+		if (now < rec->expires + (rec->grace > cache_grace ? rec->grace : cache_grace)
+			&& (line = reserve_cache(key, key + rec->host_len + 1, rec->size, rec->expires))) {
+			memcpy(cache_data(line), key + rec->key_len, rec->size);
+			line->fetched = rec->fetched;
+			commit_cache(line);
+			loaded++;
+		}
+		p += (sizeof(snapshot_record) + rec->key_len + rec->size + 7) & ~(size_t)7;
+	}
+	munmap(map, st.st_size);
+	return loaded;
+}
+
+/* write_snapshot - one record: header, key, then the rendered response */
+static int write_snapshot(FILE *fp, cache_line *line)
+{
+	static const char pad[8];
+	snapshot_record rec;
+	size_t len = sizeof(rec) + line->key_len + cache_response_size(line);
+
+	rec.key_len = line->key_len;
+	rec.host_len = line->host_len;
+	rec.size = cache_response_size(line);
+	rec.expires = __atomic_load_n(&line->expires, __ATOMIC_RELAXED);
+	rec.fetched = __atomic_load_n(&line->fetched, __ATOMIC_RELAXED);
+	rec.grace = line->grace;
+	return fwrite(&rec, sizeof(rec), 1, fp) == 1
+		&& fwrite(line->key, 1, line->key_len, fp) == line->key_len
+		&& fwrite(cache_response(line), 1, rec.size, fp) == rec.size
+		&& (len % 8 == 0 || fwrite(pad, 1, 8 - len % 8, fp) == 8 - len % 8);
+}
+
+/* Epoch Functions */
+
+/*
+ * epoch_enter - announce the current epoch before following any cache
+ * pointer. The sequentially consistent store orders the announcement
+ * before the reads that follow it, so a writer scanning the records
+ * after an unlink either sees this reader or this reader cannot reach
+ * the unlinked object.
+ */
+static void epoch_enter()
+{
+	epoch_record *rec = my_record;
+
+	if (!rec) {
+		for (rec = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); rec; rec = rec->next_record) {
+			int unused = 0;
+			if (__atomic_compare_exchange_n(&rec->in_use, &unused, 1, 0,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+				break;
+		}
+		if (!rec) {
+			rec = Calloc(1, sizeof(epoch_record));
+			rec->in_use = 1;
+			rec->next_record = __atomic_load_n(&epoch_records, __ATOMIC_RELAXED);
+			while (!__atomic_compare_exchange_n(&epoch_records, &rec->next_record, rec, 0,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+				;
+		}
+		my_record = rec;
+		pthread_setspecific(epoch_key, rec);
+	}
+	__atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST), __ATOMIC_RELAXED);
+	__atomic_store_n(&rec->active, 1, __ATOMIC_SEQ_CST);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void epoch_leave()
+{
+	__atomic_store_n(&my_record->active, 0, __ATOMIC_RELEASE);
+}
+
+/* epoch_release - thread exit: hand the record to the next thread */
+static void epoch_release(void *ptr)
+{
+	epoch_record *rec = ptr;
+
+	__atomic_store_n(&rec->active, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&rec->in_use, 0, __ATOMIC_RELEASE);
+}
+
+/* retire - free ptr with destroy once no reader can still hold it */
+static void retire(void *ptr, void (*destroy)(void*))
+{
+	retired *r = Malloc(sizeof(retired));
+
+	r->ptr = ptr;
+	r->destroy = destroy;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);	/* the unlink happens before the tag */
+	r->epoch = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&retire_lock);
+	r->next_retired = retired_list;
+	retired_list = r;
+	pthread_mutex_unlock(&retire_lock);
+}
+
+/*
+ * reclaim - advance the global epoch when every active reader has caught
+ * up with it, then free whatever was retired before the oldest epoch
+ * still announced by an active reader.
+ */
+static void reclaim()
+{
+	epoch_record *rec;
+	retired *r, **link, *doomed = NULL;
+	unsigned long global, oldest;
+
+	if (pthread_mutex_trylock(&retire_lock) != 0)
+		return;		/* someone else is reclaiming */
+	if (!retired_list) {
+		pthread_mutex_unlock(&retire_lock);
+		return;
+	}
+
+	global = oldest = __atomic_load_n(&global_epoch, __ATOMIC_SEQ_CST);
+	for (rec = __atomic_load_n(&epoch_records, __ATOMIC_ACQUIRE); rec; rec = rec->next_record)
+		if (__atomic_load_n(&rec->active, __ATOMIC_SEQ_CST)) {
+			unsigned long e = __atomic_load_n(&rec->epoch, __ATOMIC_RELAXED);
+			if (e < oldest)
+				oldest = e;
+		}
+	if (oldest == global) {
+		__atomic_store_n(&global_epoch, global + 1, __ATOMIC_SEQ_CST);
+	}
+
+	for (link = &retired_list; (r = *link); ) {
+		if (r->epoch < oldest) {
+			*link = r->next_retired;
+			r->next_retired = doomed;
+			doomed = r;
+		} else
+			link = &r->next_retired;
+	}
+	pthread_mutex_unlock(&retire_lock);
+
+	while ((r = doomed)) {
+		doomed = r->next_retired;
+		r->destroy(r->ptr);
+		Free(r);
+	}
+}
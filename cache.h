@@ -0,0 +1,234 @@
+/*
+ * cache.h - main memory cache of web objects for the proxy
+ */
+#ifndef __CACHE_H__
+#define __CACHE_H__
+
+#include "csapp.h"
+#include "slab.h"
+#include "disk.h"
+
+/* Recommended max cache and object sizes (cachebench builds with a larger cache) */
+#ifndef MAX_CACHE_SIZE
+#define MAX_CACHE_SIZE 1049000
+#endif
+#define MAX_OBJECT_SIZE 102400
+
+/* Slab arena for cached objects: the byte budget (slab_init adds a run per class) */
+#define CACHE_ARENA_SIZE MAX_CACHE_SIZE
+
+/*
+ * The cache is split into CACHE_SHARDS independently locked shards by key
+ * hash, each holding an equal share of MAX_CACHE_SIZE. A shard must be
+ * able to hold the largest object. Lookups take no lock at all.
+ */
+#define CACHE_SHARDS 8
+#define SHARD_CAPACITY (MAX_CACHE_SIZE / CACHE_SHARDS)
+
+/* Bytes per shard the maintenance thread keeps free ahead of inserts */
+#define SHARD_RESERVE (SHARD_CAPACITY / 16)
+
+/* Initial bucket count of a shard's hash index (doubles as objects are added) */
+#define CACHE_MIN_BUCKETS 64
+
+/*
+ * Expiry timing wheel: WHEEL_LEVELS levels of WHEEL_SLOTS one-second
+ * slots each, so level n spans WHEEL_SLOTS^(n+1) seconds. The maintenance
+ * thread ticks every CACHE_TICK_MS (or sooner when inserts are queued)
+ * and inserts, expires or evicts at most EXPIRE_BATCH objects per shard
+ * lock hold.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+#define CACHE_TICK_MS 250
+#define EXPIRE_BATCH 32
+
+/*
+ * Snapshot file (save_cache, load_cache): a snapshot_header, then per
+ * object a snapshot_record, its key and its rendered response, padded to
+ * 8 bytes.
+ */
+#define SNAPSHOT_MAGIC 0x70787331			/* "pxs1" */
+#define SNAPSHOT_VERSION 3
+
+typedef struct snapshot_header
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned long long count;		/* records that follow */
+} snapshot_header;
+
+typedef struct snapshot_record
+{
+	unsigned int key_len;			/* bytes of key, both NULs included */
+	unsigned int host_len;
+	unsigned long long size;		/* bytes of response */
+	long long expires;
+	long long fetched;
+	long long grace;
+} snapshot_record;
+
+/*
+ * W-TinyLFU: admission window and protected segment as percent of a
+ * shard. The window is also kept large enough for TINYLFU_WINDOW_OBJECTS
+ * objects of the shard's average size, up to half the shard, as long as
+ * the rest still holds an object of MAX_OBJECT_SIZE.
+ */
+#define TINYLFU_WINDOW_PCT 1
+#define TINYLFU_WINDOW_OBJECTS 4
+#define TINYLFU_PROTECTED_PCT 80		/* of the main (non-window) space */
+#define SKETCH_DEPTH 4
+#define SKETCH_WIDTH 1024				/* counters per row, a power of two */
+#define SKETCH_RESET (10 * SKETCH_WIDTH)	/* samples before all counters halve */
+
+/*
+ * A cached object is one slab chunk: this header, the key ("hostname\0path\0")
+ * and the response, so all of it is charged against the cache. Its
+ * headers are rendered for hits when it is committed: hop-by-hop headers
+ * and Age are dropped and the rest moved up against the body, so a hit
+ * is the header block, an Age line and the body (cache_body) as they lie. The
+ * entry is immutable once inserted (but for its freshness, see
+ * refresh_cache) and reference counted: the index holds
+ * one reference and every in-flight hit another, so an evicted entry is
+ * freed only when its last reader is done with it.
+ */
+typedef struct cache_line
+{
+	int refcnt;
+	unsigned int key_len;			/* bytes of key, both NULs included */
+	unsigned int host_len;			/* strlen(hostname) */
+	unsigned long size;				/* bytes of data, see cache_response */
+	unsigned int head_off;			/* rendered response starts this far into the data */
+	unsigned int head_len;			/* its status line and headers, blank line not
+									   included; 0 if it has no complete header block */
+	unsigned long charge;			/* bytes of slab chunk, counted in the shard */
+	unsigned long long hash;		/* hash_key(hostname, path) */
+	time_t expires;					/* stale from then on; moved by revalidation */
+	time_t fetched;					/* when the origin sent it, less its Age; for Age */
+	long grace;						/* seconds it is kept past expires for stale serving */
+	int refreshing;					/* a background revalidation is under way */
+	int on_disk;					/* promoted from the disk tier, which still has it */
+	int unlinked;					/* removed from the shard, under lru_lock */
+	int referenced;					/* CLOCK reference bit, set by hits */
+	int segment;					/* TinyLFU: WINDOW, PROBATION or PROTECTED */
+	unsigned int frequency;			/* GDSF: hits + 1, bumped lock-free */
+	unsigned int scored;			/* GDSF: frequency the priority reflects */
+	double priority;				/* GDSF: inflation + frequency * cost / size */
+	size_t heap_index;				/* GDSF: position in the shard's heap */
+	struct cache_line* next_line;	/* LRU: towards the least recently used */
+	struct cache_line* prev_line;	/* LRU: towards the most recently used */
+	struct cache_line* next_hash;	/* bucket chain of the hash index */
+	struct cache_line* wheel_next;	/* expiry timing wheel slot, then the demotion queue */
+	struct cache_line** wheel_pprev;	/* link pointing at us, NULL if in no slot */
+	char key[];						/* then the body, see cache_data */
+} cache_line;
+
+#define cache_host(line) ((line)->key)
+#define cache_path(line) ((line)->key + (line)->host_len + 1)
+#define cache_data(line) ((line)->key + (line)->key_len)
+#define cache_response(line) (cache_data(line) + (line)->head_off)
+#define cache_response_size(line) ((line)->size - (line)->head_off)
+#define cache_body(line) (cache_response(line) + (line)->head_len + 2)
+#define cache_body_size(line) (cache_response_size(line) - (line)->head_len - 2)
+
+/* Bucket array of a shard's hash index, replaced as a whole when it grows */
+typedef struct cache_index
+{
+	size_t buckets;					/* always a power of two */
+	cache_line *head[];
+} cache_index;
+
+typedef struct cache_shard
+{
+	pthread_mutex_t lock;			/* writers: insert, replace, evict */
+	pthread_mutex_t lru_lock;		/* policy state touched by hits */
+	cache_line root;				/* LRU list / CLOCK ring / TinyLFU window sentinel */
+	cache_line *hand;				/* CLOCK hand */
+	cache_line probation;			/* TinyLFU main segments */
+	cache_line protected;
+	size_t segment_size[3];			/* TinyLFU bytes per segment */
+	size_t segment_count[3];		/* TinyLFU objects per segment */
+	unsigned char *sketch;			/* TinyLFU count-min sketch */
+	unsigned int samples;			/* sketch increments since the last halving */
+	cache_line **heap;				/* GDSF min-heap on priority */
+	size_t heap_len;
+	size_t heap_cap;
+	double inflation;				/* GDSF clock: priority of the last victim */
+	cache_line *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+	time_t wheel_time;				/* next second the wheel expires */
+	cache_line *pending;			/* committed, waiting to be inserted (LIFO) */
+	cache_index *index;				/* read without locks */
+	size_t count;
+	size_t size;					/* bytes of slab chunks charged */
+} cache_shard;
+
+/*
+ * Epoch-based reclamation: a reader announces the global epoch it saw
+ * while it follows cache pointers without locks. Unlinked objects are
+ * retired with the epoch of their removal and freed once every active
+ * reader has moved past it.
+ */
+typedef struct epoch_record
+{
+	unsigned long epoch;
+	int active;
+	int in_use;						/* owned by a live thread */
+	struct epoch_record *next_record;
+} epoch_record;
+
+/*
+ * Replacement policy. hit runs on the lock-free read path; the other
+ * hooks run with the shard lock held. insert makes room for a new line
+ * (evicting through remove_cache) and links it, or returns 0 to leave it
+ * out of the cache; remove unlinks a line from the policy's structures;
+ * evict removes the policy's next victim, returning 0 if there is none.
+ * init, if set, runs once per shard.
+ */
+typedef struct cache_policy
+{
+	char *name;
+	void (*init)(cache_shard*);
+	void (*hit)(cache_shard*, cache_line*);
+	int (*insert)(cache_shard*, cache_line*);
+	void (*remove)(cache_shard*, cache_line*);
+	int (*evict)(cache_shard*);
+} cache_policy;
+
+extern cache_policy lru_policy, clock_policy, tinylfu_policy;
+extern cache_policy gdsf_policy, gdsf_bytes_policy;
+
+typedef struct retired
+{
+	void *ptr;
+	void (*destroy)(void*);
+	unsigned long epoch;
+	struct retired *next_retired;
+} retired;
+
+extern size_t cache_size;
+extern long cache_grace;
+extern int cache_memfd;
+extern cache_policy *policy;
+
+void initialize_cache();
+void insert_cache(char*, char*, char*, size_t, time_t);
+cache_line *reserve_cache(char*, char*, size_t, time_t);
+void commit_cache(cache_line*);
+void abandon_cache(cache_line*);
+void settle_cache();
+void release_cache(cache_line*);
+void destruct_cache();
+cache_line *search_cache(char*, char*);
+cache_line *peek_cache(char*, char*);
+int fresh_cache(cache_line*, long);
+void refresh_cache(cache_line*, time_t);
+int start_refresh(cache_line*);
+void end_refresh(cache_line*);
+unsigned long long hash_key(char*, char*);
+int set_cache_policy(char*);
+int save_cache(char*);
+int load_cache(char*);
+void remove_cache(cache_shard*, cache_line*);
+
+#endif /* __CACHE_H__ */
@@ -0,0 +1,384 @@
+/*
+ * cachebench.c - benchmarks for the proxy cache
+ *
+ * Linked against the cache objects built again with a cache big enough
+ * for a million entries (see the bench target in the Makefile):
+ *
+ *     cachebench evict <entries> [policy]
+ *     cachebench stress <threads> [policy]
+ *     cachebench trace [policy]
+ *
+ * evict fills the cache with <entries> objects, sized so that about that
+ * many fit, then inserts as many new ones, each of which has to evict an
+ * old one, and finally looks every new one up. It reports the time per
+ * insert of both rounds and per lookup; with O(1) eviction they stay
+ * flat from 10k to 1M entries. Inserts are committed in batches of
+ * BENCH_BATCH and settled (settle_cache) after each, so the maintenance
+ * thread's inserting and evicting is part of the time.
+ *
+ * stress runs <threads> threads against STRESS_KEYS objects for
+ * STRESS_SECONDS twice: first on random keys, one lookup in
+ * STRESS_REPLACE replacing the object instead (and a miss inserting it),
+ * then all on one hot key. Every object carries a stamp of its key and
+ * a filler derived from it, and every hit checks all of it, so a torn,
+ * reused or wrong object counts as an error. It reports operations per
+ * second, which on enough cores should grow with the threads in both
+ * rounds: different keys never share a lock and a hot key takes none.
+ *
+ * trace replays the same trace against whichever policy it is given:
+ * TRACE_REQUESTS lookups of TRACE_KEYS objects, Zipf-distributed with
+ * TRACE_SKEW, whose sizes are spread evenly on a log scale from
+ * TRACE_MIN_OBJECT to MAX_OBJECT_SIZE, so that the catalog is several
+ * times the cache. Halfway through, a scan of TRACE_SCAN one-off objects
+ * passes by. A miss inserts the object. It reports the hit ratio and the
+ * byte hit ratio of the Zipf lookups, and of the TRACE_RECOVERY right
+ * after the scan, which show how much of the hot set the scan flushed.
+ *
+ * What the cache prints about itself goes to /dev/null; the results go
+ * to stdout.
+ */
+#include "cache.h"
+
+#define BENCH_HOST "bench.example"
+#define BENCH_BATCH 256
+#define BENCH_EXPIRES 3600			/* seconds, so nothing expires during a run */
+#define STRESS_KEYS 8192
+#define STRESS_OBJECT 1024				/* bytes */
+#define STRESS_SECONDS 2
+#define STRESS_REPLACE 20				/* one operation in this many replaces */
+#define STRESS_MAX_THREADS 256
+#define TRACE_KEYS 100000
+#define TRACE_REQUESTS 1000000
+#define TRACE_SKEW 0.9					/* Zipf exponent */
+#define TRACE_MIN_OBJECT 256			/* bytes */
+#define TRACE_SCAN 20000				/* objects, more than the cache holds */
+#define TRACE_RECOVERY 100000			/* lookups after the scan reported apart */
+#define TRACE_BATCH 16					/* lookups between settles */
+
+typedef struct stress_thread
+{
+	pthread_t tid;
+	unsigned int seed;
+	int hot;						/* every lookup on key 0 */
+	unsigned long ops;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long inserts;
+	unsigned long errors;
+} stress_thread;
+
+typedef struct trace_stats
+{
+	unsigned long requests;
+	unsigned long hits;
+	double bytes;
+	double hit_bytes;
+} trace_stats;
+
+static FILE *results;
+static int stress_stop;
+
+static double now_ns();
+static void bench_path(char*, size_t, char*, long);
+static long insert_round(char*, long, size_t);
+static void evict_bench(long);
+static int stress_insert(long, unsigned int);
+static int stress_check(cache_line*, long);
+static void *stress_thread_run(void*);
+static void stress_round(stress_thread*, int, int);
+static void stress_bench(int);
+static void trace_request(char*, long, size_t, trace_stats*);
+static void trace_bench();
+
+int main(int argc, char **argv)
+{
+	if (!(results = fdopen(dup(STDOUT_FILENO), "w")) || !freopen("/dev/null", "w", stdout))
+		unix_error("cachebench: stdout error");
+	if (argc >= 4 && set_cache_policy(argv[3]) < 0) {
+		fprintf(stderr, "unknown policy '%s'\n", argv[3]);
+		exit(1);
+	}
+	if (argc >= 3 && strcmp(argv[1], "evict") == 0 && atol(argv[2]) > 0) {
+		initialize_cache();
+		evict_bench(atol(argv[2]));
+		return 0;
+	}
+	if (argc >= 3 && strcmp(argv[1], "stress") == 0
+		&& atoi(argv[2]) > 0 && atoi(argv[2]) <= STRESS_MAX_THREADS) {
+		initialize_cache();
+		stress_bench(atoi(argv[2]));
+		return 0;
+	}
+	if (argc >= 2 && strcmp(argv[1], "trace") == 0) {
+		if (argc >= 3 && set_cache_policy(argv[2]) < 0) {
+			fprintf(stderr, "unknown policy '%s'\n", argv[2]);
+			exit(1);
+		}
+		initialize_cache();
+		trace_bench();
+		return 0;
+	}
+	fprintf(stderr, "usage: %s evict <entries> [policy]\n"
+		"       %s stress <threads> [policy]\n"
+		"       %s trace [policy]\n", argv[0], argv[0], argv[0]);
+	exit(1);
+}
+
+static double now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void bench_path(char *buf, size_t len, char *round, long i)
+{
+	snprintf(buf, len, "/%s/%ld", round, i);
+}
+
+/*
+ * insert_round - insert entries objects of size bytes under /round/<i>,
+ * settling every BENCH_BATCH. An object is only a blank line and filler,
+ * so render_cache leaves it as it is. Returns the inserts that found no
+ * chunk.
+ */
+static long insert_round(char *round, long entries, size_t size)
+{
+	char path[MAXLINE];
+	cache_line *line;
+	long i, dropped = 0;
+
+	for (i = 0; i < entries; i++) {
+		bench_path(path, sizeof(path), round, i);
+		if ((line = reserve_cache(BENCH_HOST, path, size, time(NULL) + BENCH_EXPIRES))) {
+			memcpy(cache_data(line), "\r\n", 2);
+			commit_cache(line);
+		} else
+			dropped++;
+		if (i % BENCH_BATCH == BENCH_BATCH - 1)
+			settle_cache();
+	}
+	settle_cache();
+	return dropped;
+}
+
+static void evict_bench(long entries)
+{
+	char path[MAXLINE];
+	size_t size, overhead;
+	cache_line *line;
+	long i, hits = 0, dropped;
+	double start, fill, evict, lookup;
+
+	bench_path(path, sizeof(path), "evict", entries);
+	overhead = sizeof(cache_line) + strlen(BENCH_HOST) + strlen(path) + 2;
+	size = MAX_CACHE_SIZE / entries > overhead + 2 ? MAX_CACHE_SIZE / entries - overhead : 2;
+	if (size > MAX_OBJECT_SIZE)
+		size = MAX_OBJECT_SIZE;
+
+	start = now_ns();
+	dropped = insert_round("fill", entries, size);
+	fill = now_ns() - start;
+
+	start = now_ns();
+	dropped += insert_round("evict", entries, size);
+	evict = now_ns() - start;
+
+	start = now_ns();
+	for (i = 0; i < entries; i++) {
+		bench_path(path, sizeof(path), "evict", i);
+		if ((line = search_cache(path, BENCH_HOST))) {
+			hits++;
+			release_cache(line);
+		}
+	}
+	lookup = now_ns() - start;
+
+	fprintf(results, "%s, %ld entries of %zu bytes (%ld resident, %ld dropped): "
+		"fill %.0f ns/insert, evict %.0f ns/insert, lookup %.0f ns\n",
+		policy->name, entries, size, hits, dropped,
+		fill / entries, evict / entries, lookup / entries);
+}
+
+/*
+ * stress_insert - insert (or replace) key with an object stamped with
+ * key and version: a blank line, the stamp at offset 8, then filler
+ * bytes derived from the stamp. Returns 0 if no chunk was free.
+ */
+static int stress_insert(long key, unsigned int version)
+{
+	unsigned long long stamp = (unsigned long long)key << 32 | version;
+	char path[MAXLINE], *data;
+	cache_line *line;
+
+	bench_path(path, sizeof(path), "stress", key);
+	if (!(line = reserve_cache(BENCH_HOST, path, STRESS_OBJECT, time(NULL) + BENCH_EXPIRES)))
+		return 0;
+	data = cache_data(line);
+	memcpy(data, "\r\n\0\0\0\0\0\0", 8);
+	memcpy(data + 8, &stamp, sizeof(stamp));
+	memset(data + 16, (unsigned char)(stamp ^ stamp >> 32), STRESS_OBJECT - 16);
+	commit_cache(line);
+	return 1;
+}
+
+/* stress_check - whether a hit is key's object and whole */
+static int stress_check(cache_line *line, long key)
+{
+	unsigned long long stamp;
+	unsigned char *data = (unsigned char*)cache_data(line), fill;
+	size_t i;
+
+	if (line->size != STRESS_OBJECT)
+		return 0;
+	memcpy(&stamp, data + 8, sizeof(stamp));
+	if ((long)(stamp >> 32) != key || memcmp(data, "\r\n", 2) != 0)
+		return 0;
+	fill = (unsigned char)(stamp ^ stamp >> 32);
+	for (i = 16; i < STRESS_OBJECT; i++)
+		if (data[i] != fill)
+			return 0;
+	return 1;
+}
+
+static void *stress_thread_run(void *vargp)
+{
+	stress_thread *t = vargp;
+	char path[MAXLINE];
+	cache_line *line;
+	long key;
+
+	for (; !__atomic_load_n(&stress_stop, __ATOMIC_RELAXED); t->ops++) {
+		key = t->hot ? 0 : rand_r(&t->seed) % STRESS_KEYS;
+		if (!t->hot && rand_r(&t->seed) % STRESS_REPLACE == 0) {
+			t->inserts += stress_insert(key, rand_r(&t->seed));
+			continue;
+		}
+		bench_path(path, sizeof(path), "stress", key);
+		if ((line = search_cache(path, BENCH_HOST))) {
+			t->hits++;
+			if (!stress_check(line, key))
+				t->errors++;
+			release_cache(line);
+		} else {
+			t->misses++;
+			t->inserts += stress_insert(key, rand_r(&t->seed));
+		}
+	}
+	return NULL;
+}
+
+/* stress_round - run nthreads threads for STRESS_SECONDS and report */
+static void stress_round(stress_thread *threads, int nthreads, int hot)
+{
+	unsigned long ops = 0, hits = 0, misses = 0, inserts = 0, errors = 0;
+	double start, elapsed;
+	int i;
+
+	__atomic_store_n(&stress_stop, 0, __ATOMIC_RELAXED);
+	start = now_ns();
+	for (i = 0; i < nthreads; i++) {
+		memset(&threads[i], 0, sizeof(stress_thread));
+		threads[i].seed = i * 7919 + 1;
+		threads[i].hot = hot;
+		Pthread_create(&threads[i].tid, NULL, stress_thread_run, &threads[i]);
+	}
+	sleep(STRESS_SECONDS);
+	__atomic_store_n(&stress_stop, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < nthreads; i++) {
+		Pthread_join(threads[i].tid, NULL);
+		ops += threads[i].ops;
+		hits += threads[i].hits;
+		misses += threads[i].misses;
+		inserts += threads[i].inserts;
+		errors += threads[i].errors;
+	}
+	elapsed = (now_ns() - start) / 1e9;
+
+	fprintf(results, "%s, %d thread%s, %s: %.0f ops/s (%lu hits, %lu misses, %lu inserts), %lu errors\n",
+		policy->name, nthreads, nthreads == 1 ? "" : "s", hot ? "one hot key" : "random keys",
+		ops / elapsed, hits, misses, inserts, errors);
+	fflush(results);
+}
+
+static void stress_bench(int nthreads)
+{
+	stress_thread *threads = Calloc(nthreads, sizeof(stress_thread));
+	long key;
+
+	for (key = 0; key < STRESS_KEYS; key++) {
+		stress_insert(key, 0);
+		if (key % BENCH_BATCH == BENCH_BATCH - 1)
+			settle_cache();
+	}
+	settle_cache();
+
+	stress_round(threads, nthreads, 0);
+	stress_round(threads, nthreads, 1);
+	Free(threads);
+}
+
+/*
+ * trace_request - look key up under /round/, inserting it on a miss, and
+ * count the outcome in stats; every TRACE_BATCH lookups the inserts are
+ * settled so that later lookups see them
+ */
+static void trace_request(char *round, long key, size_t size, trace_stats *stats)
+{
+	static unsigned long batch;
+	char path[MAXLINE];
+	cache_line *line;
+
+	bench_path(path, sizeof(path), round, key);
+	if ((line = search_cache(path, BENCH_HOST))) {
+		stats->hits++;
+		stats->hit_bytes += size;
+		release_cache(line);
+	} else if ((line = reserve_cache(BENCH_HOST, path, size, time(NULL) + BENCH_EXPIRES))) {
+		memcpy(cache_data(line), "\r\n", 2);
+		commit_cache(line);
+	}
+	stats->requests++;
+	stats->bytes += size;
+	if (++batch % TRACE_BATCH == 0)
+		settle_cache();
+}
+
+static void trace_bench()
+{
+	static size_t sizes[TRACE_KEYS];
+	static double cdf[TRACE_KEYS];
+	trace_stats rest = { 0 }, recovery = { 0 }, scan = { 0 };
+	unsigned int seed = 1;
+	double sum = 0, catalog = 0, u;
+	long i, key, lo, hi;
+
+	for (key = 0; key < TRACE_KEYS; key++) {
+		u = (double)rand_r(&seed) / RAND_MAX;
+		sizes[key] = TRACE_MIN_OBJECT * pow((double)MAX_OBJECT_SIZE / TRACE_MIN_OBJECT, u);
+		catalog += sizes[key];
+		cdf[key] = sum += 1 / pow(key + 1, TRACE_SKEW);
+	}
+	for (i = 0; i < TRACE_REQUESTS; i++) {
+		if (i == TRACE_REQUESTS / 2)
+			for (key = 0; key < TRACE_SCAN; key++)
+				trace_request("scan", key, sizes[key], &scan);
+		u = (double)rand_r(&seed) / RAND_MAX * sum;
+		for (lo = 0, hi = TRACE_KEYS - 1; lo < hi; ) {	/* the first key whose cdf reaches u */
+			key = (lo + hi) / 2;
+			if (cdf[key] < u)
+				lo = key + 1;
+			else
+				hi = key;
+		}
+		trace_request("trace", lo, sizes[lo],
+			i >= TRACE_REQUESTS / 2 && i < TRACE_REQUESTS / 2 + TRACE_RECOVERY ? &recovery : &rest);
+	}
+	fprintf(results, "%s, %d lookups, Zipf %.1f over %d objects (%.0f MB), a %.0f MB scan halfway: "
+		"hit ratio %.1f%%, byte hit ratio %.1f%%; after the scan %.1f%%, %.1f%%\n",
+		policy->name, TRACE_REQUESTS, TRACE_SKEW, TRACE_KEYS, catalog / (1 << 20),
+		scan.bytes / (1 << 20), 100.0 * (rest.hits + recovery.hits) / (rest.requests + recovery.requests),
+		100 * (rest.hit_bytes + recovery.hit_bytes) / (rest.bytes + recovery.bytes),
+		100.0 * recovery.hits / recovery.requests, 100 * recovery.hit_bytes / recovery.bytes);
+}
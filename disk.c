@@ -0,0 +1,445 @@
+/*
+ * disk.c - log-structured disk tier behind the memory cache
+ *
+ * Objects the memory cache evicts, and objects too big for it, are
+ * appended to the active segment file as one record each: a disk_record
+ * header, the key and the response. Small records are gathered in a
+ * write buffer and reach the file DISK_WRITE_BUF bytes at a time (or on
+ * disk_flush); bigger ones go straight to the file. Nothing in a
+ * segment is ever overwritten, so the files only see sequential writes.
+ *
+ * Where each key's latest record lives is kept in an in-memory hash
+ * index; storing a key again, or forgetting it, only makes the old
+ * record dead. Readers open an object (pinning its segment), pread the
+ * body and close it again. When the active segment is full a new one is
+ * started, and when that was the last free slot the segment with the
+ * fewest live bytes is cleaned: its live records are copied forward if
+ * they are few, or dropped from the tier otherwise, and the file goes
+ * away with its last reader. One lock covers the index and the segments;
+ * reads from the file happen outside it.
+ */
+#include "disk.h"
+
+int disk_active = 0;
+
+static char disk_dir[MAXLINE];
+static disk_segment segments[DISK_SEGMENTS];
+static disk_segment *active;
+static unsigned int next_id;
+static disk_entry *disk_index[DISK_BUCKETS];
+static char *write_buf;				/* bytes of active from flushed to used */
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void segment_name(disk_segment*, char*);
+static disk_segment *open_segment();
+static void close_segment(disk_segment*);
+static int write_at(int, char*, size_t, size_t);
+static void flush(disk_segment*);
+static int roll();
+static void clean();
+static long append(disk_record*, char*, char*);
+static disk_entry **find(char*, char*, unsigned long long);
+static size_t record_len(disk_entry*);
+static void drop(disk_entry**);
+
+/*
+ * disk_init - use dir for segment files, discarding any an earlier run
+ * left there. Returns -1 if dir cannot be used; the tier stays off then.
+ */
+int disk_init(char *dir)
+{
+	char name[MAXLINE * 2];
+	struct dirent *de;
+	DIR *d;
+	int i;
+
+	if (!(d = opendir(dir)))
+		return -1;
+	snprintf(disk_dir, sizeof(disk_dir), "%s", dir);
+	while ((de = readdir(d)))
+		if (strncmp(de->d_name, "seg-", 4) == 0) {
+			snprintf(name, sizeof(name), "%s/%s", disk_dir, de->d_name);
+			unlink(name);
+		}
+	closedir(d);
+
+	for (i = 0; i < DISK_SEGMENTS; i++)
+		segments[i].fd = -1;
+	write_buf = Malloc(DISK_WRITE_BUF);
+	if (!(active = open_segment()))
+		return -1;
+	disk_active = 1;
+	return 0;
+}
+
+/*
+ * disk_store - append an object under hostname + path (hash as the
+ * memory cache computes it), replacing any older record of it. Objects
+ * over DISK_MAX_OBJECT are not stored.
+ */
+void disk_store(char *hostname, char *path, unsigned long long hash, char *data, size_t size,
+	time_t expires, time_t fetched)
+{
+	disk_record rec;
+	disk_entry **link, *entry;
+	char *key;
+	long offset;
+
+	if (!disk_active || size > DISK_MAX_OBJECT)
+		return;
+	rec.magic = DISK_MAGIC;
+	rec.host_len = strlen(hostname);
+	rec.key_len = rec.host_len + strlen(path) + 2;
+	rec.pad = 0;
+	rec.size = size;
+	rec.hash = hash;
+	rec.expires = expires;
+	rec.fetched = fetched;
+	key = Malloc(rec.key_len);
+	memcpy(key, hostname, rec.host_len + 1);
+	strcpy(key + rec.host_len + 1, path);
+
+	pthread_mutex_lock(&disk_lock);
+	if (*(link = find(hostname, path, hash)))
+		drop(link);
+	if ((offset = append(&rec, key, data)) < 0) {
+		pthread_mutex_unlock(&disk_lock);
+		Free(key);
+		return;
+	}
+	entry = Malloc(sizeof(disk_entry));
+	entry->hash = hash;
+	entry->segment = active;
+	entry->offset = offset;
+	entry->size = size;
+	entry->expires = expires;
+	entry->fetched = fetched;
+	entry->key_len = rec.key_len;
+	entry->host_len = rec.host_len;
+	entry->key = key;
+	entry->next_entry = disk_index[hash & (DISK_BUCKETS - 1)];
+	disk_index[hash & (DISK_BUCKETS - 1)] = entry;
+	active->live += record_len(entry);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* disk_forget - drop the tier's copy of an object the origin has replaced */
+void disk_forget(char *hostname, char *path, unsigned long long hash)
+{
+	disk_entry **link;
+
+	pthread_mutex_lock(&disk_lock);
+	if (*(link = find(hostname, path, hash)))
+		drop(link);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * disk_open - find an object and pin its segment for disk_read. Returns 0
+ * if the tier has no copy; otherwise the caller must disk_close obj.
+ */
+int disk_open(char *hostname, char *path, unsigned long long hash, disk_object *obj)
+{
+	disk_entry *entry;
+
+	if (!disk_active)
+		return 0;
+	pthread_mutex_lock(&disk_lock);
+	if ((entry = *find(hostname, path, hash))) {
+		obj->segment = entry->segment;
+		obj->offset = entry->offset + sizeof(disk_record) + entry->key_len;
+		obj->size = entry->size;
+		obj->expires = entry->expires;
+		obj->fetched = entry->fetched;
+		entry->segment->refs++;
+	}
+	pthread_mutex_unlock(&disk_lock);
+	return entry != NULL;
+}
+
+/*
+ * disk_read - copy up to len bytes of an open object's body, starting at
+ * pos, into buf. A record still in the write buffer is copied from there
+ * under the lock; flushed ones are read from the file outside it.
+ * Returns the bytes read, or -1 on a read error.
+ */
+ssize_t disk_read(disk_object *obj, char *buf, size_t len, size_t pos)
+{
+	disk_segment *seg = obj->segment;
+	size_t offset = obj->offset + pos, done = 0;
+	ssize_t n;
+
+	if (pos >= obj->size)
+		return 0;
+	if (len > obj->size - pos)
+		len = obj->size - pos;
+
+	pthread_mutex_lock(&disk_lock);
+	if (offset >= seg->flushed) {	/* records never straddle the flush point */
+		memcpy(buf, write_buf + (offset - seg->flushed), len);
+		pthread_mutex_unlock(&disk_lock);
+		return len;
+	}
+	pthread_mutex_unlock(&disk_lock);
+
+	while (done < len) {
+		if ((n = pread(seg->fd, buf + done, len - done, offset + done)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			return -1;			/* the file is shorter than the index says */
+		done += n;
+	}
+	return done;
+}
+
+/* disk_close - unpin an object's segment; a cleaned one goes with its last reader */
+void disk_close(disk_object *obj)
+{
+	pthread_mutex_lock(&disk_lock);
+	if (--obj->segment->refs == 0 && obj->segment->doomed)
+		close_segment(obj->segment);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* disk_flush - write out whatever the write buffer gathered so far */
+void disk_flush()
+{
+	if (!disk_active)
+		return;
+	pthread_mutex_lock(&disk_lock);
+	flush(active);
+	pthread_mutex_unlock(&disk_lock);
+}
+
+/* Segment Functions (disk_lock held) */
+static void segment_name(disk_segment *seg, char *name)
+{
+	snprintf(name, MAXLINE * 2, "%s/seg-%08u.log", disk_dir, seg->id);
+}
+
+/* open_segment - start a new, empty segment file in a free slot, or NULL */
+static disk_segment *open_segment()
+{
+	char name[MAXLINE * 2];
+	disk_segment *seg = NULL;
+	int i;
+
+	for (i = 0; i < DISK_SEGMENTS && !seg; i++)
+		if (segments[i].fd < 0)
+			seg = &segments[i];
+	if (!seg)
+		return NULL;
+	seg->id = next_id++;
+	segment_name(seg, name);
+	if ((seg->fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0) {
+		fprintf(stderr, "disk tier: cannot create %s: %s\n", name, strerror(errno));
+		return NULL;
+	}
+	seg->used = seg->flushed = seg->live = 0;
+	seg->refs = 0;
+	seg->doomed = 0;
+	return seg;
+}
+
+/* close_segment - give up a cleaned segment: its slot is free again */
+static void close_segment(disk_segment *seg)
+{
+	char name[MAXLINE * 2];
+
+	segment_name(seg, name);
+	close(seg->fd);
+	unlink(name);
+	seg->fd = -1;
+	seg->doomed = 0;
+}
+
+/* write_at - pwrite all of buf at offset, or return -1 */
+static int write_at(int fd, char *buf, size_t len, size_t offset)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = pwrite(fd, buf, len, offset)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		offset += n;
+	}
+	return 0;
+}
+
+/*
+ * flush - write the buffered tail of the active segment. If the write
+ * fails, every record in the segment is dropped: the file can no longer
+ * be trusted.
+ */
+static void flush(disk_segment *seg)
+{
+	disk_entry **link;
+	size_t b;
+
+	if (seg->used == seg->flushed)
+		return;
+	if (write_at(seg->fd, write_buf, seg->used - seg->flushed, seg->flushed) < 0) {
+		fprintf(stderr, "disk tier: write error: %s\n", strerror(errno));
+		for (b = 0; b < DISK_BUCKETS; b++)
+			for (link = &disk_index[b]; *link; )
+				if ((*link)->segment == seg)
+					drop(link);
+				else
+					link = &(*link)->next_entry;
+	}
+	seg->flushed = seg->used;
+}
+
+/*
+ * roll - seal the active segment and start the next one, cleaning a
+ * segment if that used up the spare slot. Returns -1 if no slot is free
+ * (cleaned segments still being read hold on to theirs).
+ */
+static int roll()
+{
+	disk_segment *seg;
+	int i, spare = 0;
+
+	flush(active);
+	if (!(seg = open_segment()))
+		return -1;
+	active = seg;
+	for (i = 0; i < DISK_SEGMENTS; i++)
+		if (segments[i].fd < 0)
+			spare = 1;
+	if (!spare)
+		clean();
+	return 0;
+}
+
+/*
+ * clean - free the sealed segment with the fewest live bytes. Its live
+ * records are copied into the fresh active segment when under
+ * DISK_CLEAN_PCT percent of it is live (so they fit alongside the record
+ * being appended), or dropped from the tier otherwise.
+ */
+static void clean()
+{
+	disk_segment *victim = NULL;
+	disk_entry **link, *entry, *moving = NULL;
+	int copy, i;
+	size_t b, len;
+	long offset;
+	char *record;
+
+	for (i = 0; i < DISK_SEGMENTS; i++)
+		if (segments[i].fd >= 0 && !segments[i].doomed && &segments[i] != active
+			&& (!victim || segments[i].live < victim->live))
+			victim = &segments[i];
+	if (!victim)
+		return;
+
+	for (b = 0; b < DISK_BUCKETS; b++)	/* take its entries out first: appends may flush */
+		for (link = &disk_index[b]; (entry = *link); )
+			if (entry->segment == victim) {
+				*link = entry->next_entry;
+				entry->next_entry = moving;
+				moving = entry;
+			} else
+				link = &entry->next_entry;
+
+	copy = victim->live * 100 < (size_t)DISK_SEGMENT_SIZE * DISK_CLEAN_PCT;
+	while ((entry = moving)) {
+		moving = entry->next_entry;
+		entry->next_entry = NULL;
+		len = record_len(entry);
+		offset = -1;
+		if (copy && active->used + len <= DISK_SEGMENT_SIZE) {
+			record = Malloc(len);
+			if (pread(victim->fd, record, len, entry->offset) == len)
+				offset = append((disk_record*)record, record + sizeof(disk_record),
+					record + sizeof(disk_record) + entry->key_len);
+			Free(record);
+		}
+		if (offset < 0) {
+			drop(&entry);
+			continue;
+		}
+		victim->live -= len;
+		entry->segment = active;
+		entry->offset = offset;
+		active->live += len;
+		entry->next_entry = disk_index[entry->hash & (DISK_BUCKETS - 1)];
+		disk_index[entry->hash & (DISK_BUCKETS - 1)] = entry;
+	}
+	victim->doomed = 1;
+	if (victim->refs == 0)
+		close_segment(victim);
+}
+
+/*
+ * append - add a record to the active segment, rolling to a new one if
+ * it does not fit. Returns its offset in the (then) active segment, or -1.
+ */
+static long append(disk_record *rec, char *key, char *data)
+{
+	size_t len = sizeof(disk_record) + rec->key_len + rec->size, offset;
+	char *p;
+
+	if (active->used + len > DISK_SEGMENT_SIZE && roll() < 0)
+		return -1;
+	if (active->used - active->flushed + len > DISK_WRITE_BUF)
+		flush(active);
+	offset = active->used;
+
+	if (len > DISK_WRITE_BUF) {		/* too big to gather: straight to the file */
+		if (write_at(active->fd, (char*)rec, sizeof(disk_record), offset) < 0
+			|| write_at(active->fd, key, rec->key_len, offset + sizeof(disk_record)) < 0
+			|| write_at(active->fd, data, rec->size, offset + sizeof(disk_record) + rec->key_len) < 0) {
+			fprintf(stderr, "disk tier: write error: %s\n", strerror(errno));
+			active->used = active->flushed = offset + len;	/* never reused, just dead */
+			return -1;
+		}
+		active->used = active->flushed = offset + len;
+		return offset;
+	}
+	p = write_buf + (offset - active->flushed);
+	memcpy(p, rec, sizeof(disk_record));
+	memcpy(p + sizeof(disk_record), key, rec->key_len);
+	memcpy(p + sizeof(disk_record) + rec->key_len, data, rec->size);
+	active->used += len;
+	return offset;
+}
+
+/* Index Functions (disk_lock held) */
+
+/* find - the link to the entry for a key, pointing at NULL if there is none */
+static disk_entry **find(char *hostname, char *path, unsigned long long hash)
+{
+	disk_entry **link = &disk_index[hash & (DISK_BUCKETS - 1)];
+
+	for (; *link; link = &(*link)->next_entry)
+		if ((*link)->hash == hash && strcmp(path, (*link)->key + (*link)->host_len + 1) == 0
+			&& strcasecmp(hostname, (*link)->key) == 0)
+			break;
+	return link;
+}
+
+static size_t record_len(disk_entry *entry)
+{
+	return sizeof(disk_record) + entry->key_len + entry->size;
+}
+
+/* drop - unlink and free an entry; its record is dead from now on */
+static void drop(disk_entry **link)
+{
+	disk_entry *entry = *link;
+
+	*link = entry->next_entry;
+	entry->segment->live -= record_len(entry);
+	Free(entry->key);
+	Free(entry);
+}
@@ -0,0 +1,83 @@
+/*
+ * disk.h - log-structured disk tier behind the memory cache
+ */
+#ifndef __DISK_H__
+#define __DISK_H__
+
+#include "csapp.h"
+
+/*
+ * Objects are appended to DISK_SEGMENT_SIZE segment files, at most
+ * DISK_SEGMENTS of them (one kept spare for cleaning), gathered into
+ * writes of up to DISK_WRITE_BUF bytes. When the segments run out, the
+ * one with the fewest live bytes is cleaned: copied forward if less than
+ * DISK_CLEAN_PCT percent of it is live, dropped outright otherwise.
+ */
+#define DISK_SEGMENT_SIZE (8 * 1024 * 1024)
+#define DISK_SEGMENTS 16
+#define DISK_WRITE_BUF (256 * 1024)
+#define DISK_CLEAN_PCT 50
+#define DISK_MAX_OBJECT (DISK_SEGMENT_SIZE / 2)	/* so a cleaned segment leaves room */
+#define DISK_BUCKETS 4096				/* index hash buckets, a power of two */
+#define DISK_MAGIC 0x70786431			/* "pxd1" */
+
+/* Record header in a segment file, followed by the key and the body */
+typedef struct disk_record
+{
+	unsigned int magic;
+	unsigned int key_len;			/* bytes of key, both NULs included */
+	unsigned int host_len;
+	unsigned int pad;
+	unsigned long long size;		/* bytes of body */
+	unsigned long long hash;
+	long long expires;
+	long long fetched;
+} disk_record;
+
+typedef struct disk_segment
+{
+	int fd;							/* -1 while the slot is free */
+	unsigned int id;				/* file name: seg-<id>.log */
+	size_t used;					/* bytes appended, buffered ones included */
+	size_t flushed;					/* bytes in the file, the rest is in the write buffer */
+	size_t live;					/* bytes of records still indexed */
+	int refs;						/* readers in the file */
+	int doomed;						/* cleaned, closed by its last reader */
+} disk_segment;
+
+/* Index entry: where the latest record for a key lives */
+typedef struct disk_entry
+{
+	unsigned long long hash;
+	disk_segment *segment;
+	size_t offset;					/* of the record header */
+	size_t size;					/* bytes of body */
+	time_t expires;
+	time_t fetched;
+	unsigned int key_len;
+	unsigned int host_len;
+	char *key;						/* "hostname\0path\0" */
+	struct disk_entry *next_entry;
+} disk_entry;
+
+/* An object opened for reading; pins its segment until disk_close */
+typedef struct disk_object
+{
+	disk_segment *segment;
+	size_t offset;					/* of the body */
+	size_t size;
+	time_t expires;
+	time_t fetched;
+} disk_object;
+
+extern int disk_active;
+
+int disk_init(char*);
+void disk_store(char*, char*, unsigned long long, char*, size_t, time_t, time_t);
+void disk_forget(char*, char*, unsigned long long);
+int disk_open(char*, char*, unsigned long long, disk_object*);
+ssize_t disk_read(disk_object*, char*, size_t, size_t);
+void disk_close(disk_object*);
+void disk_flush();
+
+#endif /* __DISK_H__ */
@@ -0,0 +1,521 @@
+/*
+ * policy.c - replacement policies for the proxy cache
+ *
+ * Every policy keeps its own per-shard structures; the shard lock is held
+ * for insert and remove, while hit runs on the lock-free read path and
+ * must be cheap and safe against a concurrent remove.
+ */
+#include "cache.h"
+
+static void ring_unlink(cache_line*);
+static void ring_insert_before(cache_line*, cache_line*);
+
+/* LRU Policy */
+
+/*
+ * root is the sentinel of a circular doubly-linked recency list:
+ * root.next_line is the most recently used object and root.prev_line the
+ * eviction victim, so a hit and an eviction are O(1). The list is guarded
+ * by lru_lock; a hit only tries it and skips the bump when another thread
+ * is reordering the shard.
+ */
+static void lru_hit(cache_shard *shard, cache_line *line)
+{
+	if (pthread_mutex_trylock(&shard->lru_lock) != 0)
+		return;		/* another thread is reordering this shard, skip the bump */
+	if (!line->unlinked) {
+		ring_unlink(line);
+		ring_insert_before(shard->root.next_line, line);
+	}
+	pthread_mutex_unlock(&shard->lru_lock);
+}
+
+static int lru_evict(cache_shard *shard)
+{
+	cache_line *victim;
+
+	pthread_mutex_lock(&shard->lru_lock);	/* a hit may be relinking the tail */
+	victim = shard->root.prev_line;
+	pthread_mutex_unlock(&shard->lru_lock);
+	if (victim == &shard->root)
+		return 0;
+	remove_cache(shard, victim);
+	return 1;
+}
+
+static int lru_insert(cache_shard *shard, cache_line *line)
+{
+	while (shard->size + line->charge > SHARD_CAPACITY && lru_evict(shard))
+		;
+
+	pthread_mutex_lock(&shard->lru_lock);
+	ring_insert_before(shard->root.next_line, line);
+	pthread_mutex_unlock(&shard->lru_lock);
+	return 1;
+}
+
+static void lru_remove(cache_shard *shard, cache_line *line)
+{
+	pthread_mutex_lock(&shard->lru_lock);
+	ring_unlink(line);
+	line->unlinked = 1;
+	pthread_mutex_unlock(&shard->lru_lock);
+}
+
+cache_policy lru_policy = { "lru", NULL, lru_hit, lru_insert, lru_remove, lru_evict };
+
+/* CLOCK Policy */
+
+/*
+ * Objects sit on a ring (the same next_line/prev_line links, with root as
+ * a marker the hand skips). A hit only sets the object's reference bit
+ * with a relaxed store, so hits write no shared list pointers at all. To
+ * make room the hand sweeps the ring, clearing set bits and evicting the
+ * first object whose bit is already clear. New objects go just behind
+ * the hand, the last place it will look.
+ */
+static void clock_init(cache_shard *shard)
+{
+	shard->hand = &shard->root;
+}
+
+static void clock_hit(cache_shard *shard, cache_line *line)
+{
+	if (!__atomic_load_n(&line->referenced, __ATOMIC_RELAXED))
+		__atomic_store_n(&line->referenced, 1, __ATOMIC_RELAXED);
+}
+
+static int clock_evict(cache_shard *shard)
+{
+	while (shard->root.next_line != &shard->root) {
+		cache_line *victim = shard->hand;
+
+		if (victim == &shard->root) {
+			shard->hand = victim->next_line;
+			continue;
+		}
+		if (__atomic_load_n(&victim->referenced, __ATOMIC_RELAXED)) {
+			__atomic_store_n(&victim->referenced, 0, __ATOMIC_RELAXED);
+			shard->hand = victim->next_line;
+			continue;
+		}
+		remove_cache(shard, victim);	/* moves the hand past victim */
+		return 1;
+	}
+	return 0;
+}
+
+static int clock_insert(cache_shard *shard, cache_line *line)
+{
+	while (shard->size + line->charge > SHARD_CAPACITY && clock_evict(shard))
+		;
+	ring_insert_before(shard->hand, line);
+	return 1;
+}
+
+static void clock_remove(cache_shard *shard, cache_line *line)
+{
+	if (shard->hand == line)
+		shard->hand = line->next_line;
+	ring_unlink(line);
+	line->unlinked = 1;
+}
+
+cache_policy clock_policy = { "clock", clock_init, clock_hit, clock_insert, clock_remove, clock_evict };
+
+/* W-TinyLFU Policy */
+
+/*
+ * New objects enter a small LRU window (root). Whatever falls out of the
+ * window has to win an admission contest to enter the main space, a
+ * segmented LRU: objects arrive in probation and a second hit promotes
+ * them to protected, whose overflow drops back to probation. The contest
+ * compares the candidate's estimated access frequency, from a per-shard
+ * count-min sketch, with that of the main space's next victim; the
+ * candidate is dropped unless it is strictly more popular. One-off URLs
+ * therefore stay in the window and never flush the hot set.
+ *
+ * The sketch keeps SKETCH_DEPTH rows of 4-bit-saturating counters and
+ * halves every counter after SKETCH_RESET samples so that old popularity
+ * fades. Hits update it with lossy relaxed stores and no lock.
+ */
+#define WINDOW 0
+#define PROBATION 1
+#define PROTECTED 2
+
+#define MAIN_CAP(window) (SHARD_CAPACITY - (window))
+#define MAIN_MIN (MAX_OBJECT_SIZE + SLAB_PAGE_SIZE)	/* the largest object, header and span included */
+#define PROTECTED_CAP(window) (MAIN_CAP(window) * TINYLFU_PROTECTED_PCT / 100)
+
+/*
+ * window_cap - bytes the window may hold: TINYLFU_WINDOW_PCT of the
+ * shard, but room for TINYLFU_WINDOW_OBJECTS average objects, as a
+ * percentage of a small shard may not fit even one; and never so much
+ * that the main space cannot take the largest object (lru_lock held)
+ */
+static size_t window_cap(cache_shard *shard)
+{
+	size_t objects = shard->segment_count[WINDOW] + shard->segment_count[PROBATION]
+		+ shard->segment_count[PROTECTED];
+	size_t bytes = shard->segment_size[WINDOW] + shard->segment_size[PROBATION]
+		+ shard->segment_size[PROTECTED];
+	size_t cap = SHARD_CAPACITY * TINYLFU_WINDOW_PCT / 100, max = SHARD_CAPACITY / 2;
+
+	if (objects && bytes / objects * TINYLFU_WINDOW_OBJECTS > cap)
+		cap = bytes / objects * TINYLFU_WINDOW_OBJECTS;
+	if (SHARD_CAPACITY - max < MAIN_MIN)
+		max = SHARD_CAPACITY > MAIN_MIN ? SHARD_CAPACITY - MAIN_MIN : 0;
+	return cap < max ? cap : max;
+}
+
+static unsigned int sketch_slot(unsigned long long hash, int row)
+{
+	static const unsigned long long seeds[SKETCH_DEPTH] = {
+		0x9e3779b97f4a7c15ULL, 0xc2b2ae3d27d4eb4fULL,
+		0x165667b19e3779f9ULL, 0xd6e8feb86659fd93ULL };
+	unsigned long long h = (hash ^ (hash >> 32)) * seeds[row];
+
+	return row * SKETCH_WIDTH + (unsigned int)(h >> 32) % SKETCH_WIDTH;
+}
+
+static int sketch_frequency(cache_shard *shard, unsigned long long hash)
+{
+	int row, freq = 15;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		int count = __atomic_load_n(&shard->sketch[sketch_slot(hash, row)], __ATOMIC_RELAXED);
+		if (count < freq)
+			freq = count;
+	}
+	return freq;
+}
+
+/* sketch_increment - callers that do not hold lru_lock age through trylock */
+static void sketch_increment(cache_shard *shard, unsigned long long hash, int locked)
+{
+	int row, i;
+
+	for (row = 0; row < SKETCH_DEPTH; row++) {
+		unsigned char *count = &shard->sketch[sketch_slot(hash, row)];
+		unsigned char c = __atomic_load_n(count, __ATOMIC_RELAXED);
+		if (c < 15)
+			__atomic_store_n(count, c + 1, __ATOMIC_RELAXED);
+	}
+	if (__atomic_add_fetch(&shard->samples, 1, __ATOMIC_RELAXED) < SKETCH_RESET)
+		return;
+	if (!locked && pthread_mutex_trylock(&shard->lru_lock) != 0)
+		return;
+	if (shard->samples >= SKETCH_RESET) {
+		for (i = 0; i < SKETCH_DEPTH * SKETCH_WIDTH; i++)
+			shard->sketch[i] >>= 1;
+		__atomic_store_n(&shard->samples, 0, __ATOMIC_RELAXED);
+	}
+	if (!locked)
+		pthread_mutex_unlock(&shard->lru_lock);
+}
+
+static cache_line *segment_head(cache_shard *shard, int segment)
+{
+	return segment == WINDOW ? &shard->root
+		: segment == PROBATION ? &shard->probation : &shard->protected;
+}
+
+/* segment_push - move line to the MRU end of segment (lru_lock held) */
+static void segment_push(cache_shard *shard, cache_line *line, int segment)
+{
+	cache_line *head = segment_head(shard, segment);
+
+	ring_insert_before(head->next_line, line);
+	line->segment = segment;
+	shard->segment_size[segment] += line->charge;
+	shard->segment_count[segment]++;
+}
+
+static void segment_pop(cache_shard *shard, cache_line *line)
+{
+	ring_unlink(line);
+	shard->segment_size[line->segment] -= line->charge;
+	shard->segment_count[line->segment]--;
+}
+
+/* segment_victim - LRU end of a segment, or NULL when it is empty */
+static cache_line *segment_victim(cache_shard *shard, int segment)
+{
+	cache_line *head = segment_head(shard, segment);
+
+	return head->prev_line == head ? NULL : head->prev_line;
+}
+
+static void tinylfu_init(cache_shard *shard)
+{
+	shard->probation.next_line = shard->probation.prev_line = &shard->probation;
+	shard->protected.next_line = shard->protected.prev_line = &shard->protected;
+	memset(shard->segment_size, 0, sizeof(shard->segment_size));
+	memset(shard->segment_count, 0, sizeof(shard->segment_count));
+	shard->sketch = Calloc(SKETCH_DEPTH * SKETCH_WIDTH, 1);
+	shard->samples = 0;
+}
+
+static void tinylfu_hit(cache_shard *shard, cache_line *line)
+{
+	cache_line *demoted;
+
+	sketch_increment(shard, line->hash, 0);
+	if (pthread_mutex_trylock(&shard->lru_lock) != 0)
+		return;
+	if (!line->unlinked) {
+		int segment = line->segment == WINDOW ? WINDOW : PROTECTED;
+		size_t protected_cap = PROTECTED_CAP(window_cap(shard));
+
+		segment_pop(shard, line);
+		segment_push(shard, line, segment);
+		while (shard->segment_size[PROTECTED] > protected_cap
+			&& (demoted = segment_victim(shard, PROTECTED)) != line) {
+			segment_pop(shard, demoted);
+			segment_push(shard, demoted, PROBATION);
+		}
+	}
+	pthread_mutex_unlock(&shard->lru_lock);
+}
+
+/*
+ * tinylfu_insert - put line in the window, then run every object the
+ * window overflows through the admission contest. Returns 0 only when
+ * line itself loses, in which case it was never published.
+ */
+static int tinylfu_insert(cache_shard *shard, cache_line *line)
+{
+	cache_line *candidate, *victim;
+	size_t window;
+	int admitted = 1;
+
+	pthread_mutex_lock(&shard->lru_lock);
+	sketch_increment(shard, line->hash, 1);
+	segment_push(shard, line, WINDOW);
+	window = window_cap(shard);
+
+	while (shard->segment_size[WINDOW] > window
+		&& (candidate = segment_victim(shard, WINDOW))) {
+		int freq = sketch_frequency(shard, candidate->hash), won = 1;
+
+		while (shard->segment_size[PROBATION] + shard->segment_size[PROTECTED]
+			+ candidate->charge > MAIN_CAP(window)) {
+			if (!(victim = segment_victim(shard, PROBATION))
+				&& !(victim = segment_victim(shard, PROTECTED))) {
+				won = 0;		/* too big for even an empty main space */
+				break;
+			}
+			if (freq <= sketch_frequency(shard, victim->hash)) {
+				won = 0;
+				break;
+			}
+			pthread_mutex_unlock(&shard->lru_lock);
+			remove_cache(shard, victim);
+			pthread_mutex_lock(&shard->lru_lock);
+		}
+
+		if (won) {
+			segment_pop(shard, candidate);
+			segment_push(shard, candidate, PROBATION);
+		} else if (candidate == line) {
+			segment_pop(shard, line);
+			admitted = 0;
+		} else {
+			pthread_mutex_unlock(&shard->lru_lock);
+			remove_cache(shard, candidate);
+			pthread_mutex_lock(&shard->lru_lock);
+		}
+	}
+	pthread_mutex_unlock(&shard->lru_lock);
+	return admitted;
+}
+
+/*
+ * tinylfu_evict - outside an admission contest the least valuable object
+ * is the probation tail, then the protected tail; the window goes last
+ * as its objects have not had their chance yet.
+ */
+static int tinylfu_evict(cache_shard *shard)
+{
+	cache_line *victim;
+
+	pthread_mutex_lock(&shard->lru_lock);
+	if (!(victim = segment_victim(shard, PROBATION))
+		&& !(victim = segment_victim(shard, PROTECTED)))
+		victim = segment_victim(shard, WINDOW);
+	pthread_mutex_unlock(&shard->lru_lock);
+	if (!victim)
+		return 0;
+	remove_cache(shard, victim);
+	return 1;
+}
+
+static void tinylfu_remove(cache_shard *shard, cache_line *line)
+{
+	pthread_mutex_lock(&shard->lru_lock);
+	segment_pop(shard, line);
+	line->unlinked = 1;
+	pthread_mutex_unlock(&shard->lru_lock);
+}
+
+cache_policy tinylfu_policy = { "tinylfu", tinylfu_init, tinylfu_hit, tinylfu_insert, tinylfu_remove,
+	tinylfu_evict };
+
+/* GDSF Policy */
+
+/*
+ * GreedyDual-Size-Frequency: each object is worth
+ *
+ *     priority = inflation + frequency * cost / size
+ *
+ * and the cheapest object is evicted first, after which the shard's
+ * inflation clock rises to its priority so that long-idle objects age
+ * out. With gdsf the cost of every miss is 1, which favours many small
+ * objects (object hit ratio); gdsf-bytes charges a miss its size, so the
+ * priority reduces to inflation + frequency (byte hit ratio).
+ *
+ * Objects sit in a per-shard binary min-heap under lru_lock. A hit always
+ * bumps frequency atomically but only re-sifts when it gets the lock; the
+ * eviction loop catches up on skipped bumps by re-scoring the heap top
+ * before evicting it.
+ */
+static double gdsf_priority(cache_shard *shard, cache_line *line)
+{
+	double cost = policy == &gdsf_bytes_policy ? (double)line->charge : 1.0;
+
+	line->scored = __atomic_load_n(&line->frequency, __ATOMIC_RELAXED);
+	return shard->inflation + line->scored * cost / (line->charge ? line->charge : 1);
+}
+
+static void heap_swap(cache_shard *shard, size_t a, size_t b)
+{
+	cache_line *tmp = shard->heap[a];
+
+	shard->heap[a] = shard->heap[b];
+	shard->heap[b] = tmp;
+	shard->heap[a]->heap_index = a;
+	shard->heap[b]->heap_index = b;
+}
+
+static void heap_sift_up(cache_shard *shard, size_t i)
+{
+	while (i > 0 && shard->heap[(i - 1) / 2]->priority > shard->heap[i]->priority) {
+		heap_swap(shard, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void heap_sift_down(cache_shard *shard, size_t i)
+{
+	for (;;) {
+		size_t least = i, l = 2 * i + 1, r = 2 * i + 2;
+
+		if (l < shard->heap_len && shard->heap[l]->priority < shard->heap[least]->priority)
+			least = l;
+		if (r < shard->heap_len && shard->heap[r]->priority < shard->heap[least]->priority)
+			least = r;
+		if (least == i)
+			return;
+		heap_swap(shard, i, least);
+		i = least;
+	}
+}
+
+/* heap_update - re-score one object after its frequency changed */
+static void heap_update(cache_shard *shard, cache_line *line)
+{
+	line->priority = gdsf_priority(shard, line);
+	heap_sift_down(shard, line->heap_index);
+	heap_sift_up(shard, line->heap_index);
+}
+
+static void gdsf_init(cache_shard *shard)
+{
+	shard->heap_cap = CACHE_MIN_BUCKETS;
+	shard->heap = Malloc(shard->heap_cap * sizeof(cache_line*));
+	shard->heap_len = 0;
+	shard->inflation = 0;
+}
+
+static void gdsf_hit(cache_shard *shard, cache_line *line)
+{
+	__atomic_add_fetch(&line->frequency, 1, __ATOMIC_RELAXED);
+	if (pthread_mutex_trylock(&shard->lru_lock) != 0)
+		return;		/* the eviction loop will notice the new frequency */
+	if (!line->unlinked)
+		heap_update(shard, line);
+	pthread_mutex_unlock(&shard->lru_lock);
+}
+
+static int gdsf_evict(cache_shard *shard)
+{
+	cache_line *victim;
+
+	pthread_mutex_lock(&shard->lru_lock);
+	while (shard->heap_len) {
+		victim = shard->heap[0];
+		if (__atomic_load_n(&victim->frequency, __ATOMIC_RELAXED) != victim->scored) {
+			heap_update(shard, victim);		/* a skipped hit bump */
+			continue;
+		}
+		shard->inflation = victim->priority;
+		pthread_mutex_unlock(&shard->lru_lock);
+		remove_cache(shard, victim);
+		return 1;
+	}
+	pthread_mutex_unlock(&shard->lru_lock);
+	return 0;
+}
+
+static int gdsf_insert(cache_shard *shard, cache_line *line)
+{
+	while (shard->size + line->charge > SHARD_CAPACITY && gdsf_evict(shard))
+		;
+
+	pthread_mutex_lock(&shard->lru_lock);
+	if (shard->heap_len == shard->heap_cap) {
+		shard->heap_cap *= 2;
+		shard->heap = Realloc(shard->heap, shard->heap_cap * sizeof(cache_line*));
+	}
+	line->frequency = 1;
+	line->priority = gdsf_priority(shard, line);
+	line->heap_index = shard->heap_len;
+	shard->heap[shard->heap_len++] = line;
+	heap_sift_up(shard, line->heap_index);
+	pthread_mutex_unlock(&shard->lru_lock);
+	return 1;
+}
+
+static void gdsf_remove(cache_shard *shard, cache_line *line)
+{
+	size_t i;
+
+	pthread_mutex_lock(&shard->lru_lock);
+	i = line->heap_index;			/* a hit may have moved it until now */
+	shard->heap_len--;
+	if (i != shard->heap_len) {
+		heap_swap(shard, i, shard->heap_len);
+		heap_sift_down(shard, i);
+		heap_sift_up(shard, i);
+	}
+	line->unlinked = 1;
+	pthread_mutex_unlock(&shard->lru_lock);
+}
+
+cache_policy gdsf_policy = { "gdsf", gdsf_init, gdsf_hit, gdsf_insert, gdsf_remove, gdsf_evict };
+cache_policy gdsf_bytes_policy = { "gdsf-bytes", gdsf_init, gdsf_hit, gdsf_insert, gdsf_remove, gdsf_evict };
+
+/* Ring Functions */
+static void ring_unlink(cache_line *line)
+{
+	line->prev_line->next_line = line->next_line;
+	line->next_line->prev_line = line->prev_line;
+}
+
+static void ring_insert_before(cache_line *pos, cache_line *line)
+{
+	line->next_line = pos;
+	line->prev_line = pos->prev_line;
+	pos->prev_line->next_line = line;
+	pos->prev_line = line;
+}
@@ -25,11 +25,54 @@ Part 3 : Caching web objects
 
 #include <string.h>
 #include <stdio.h>
+#include <poll.h>
+#include <time.h>
+#include <netinet/tcp.h>
+#include <sys/select.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include "csapp.h"
+#include "cache.h"
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* Default origin -> client relay watermarks (bytes buffered in the proxy) */
+#define RELAY_HIWAT 65536
+#define RELAY_LOWAT 16384
+#define RELAY_STAGING MAXBUF	/* first buffer, until the response is sized */
+#define RELAY_ORIGIN_ERR -1
+#define RELAY_CLIENT_ERR -2
+
+/* Longest ETag or Last-Modified value kept from an origin response */
+#define RESPONSE_TAG 256
+
+/*
+ * Freshness of responses without max-age or Expires: a tenth of their
+ * age since Last-Modified up to FRESH_HEURISTIC_MAX, else FRESH_DEFAULT.
+ */
+#define FRESH_DEFAULT 300
+#define FRESH_HEURISTIC_MAX 86400
+
+/*
+ * Seconds past its deadline a stale copy may still be served while it is
+ * revalidated in the background, or when the origin fails (-g)
+ */
+#define STALE_WHILE_REVALIDATE 30
+#define STALE_IF_ERROR 300
+
+/* Seconds between cache snapshots (-p); one more is written at shutdown */
+#define SNAPSHOT_INTERVAL 60
+
+/* Origin circuit breaker defaults */
+#define HEALTH_BUCKETS 64		/* hash buckets for the per-origin table */
+#define HEALTH_WINDOW 20		/* recent outcomes remembered per origin */
+#define HEALTH_MIN_SAMPLES 5	/* outcomes needed before the circuit may open */
+#define HEALTH_FAIL_RATIO 0.5
+#define HEALTH_OPEN_SECS 10		/* time an open circuit waits before probing */
+#define HEALTH_PROBES 1			/* concurrent probes allowed while half-open */
+#define HEALTH_PROBE_SECS 30	/* a half-open circuit without a verdict by then reopens */
+
+/* Reverse-proxy backend selection */
+#define BALANCE_LOR 0			/* least outstanding requests */
+#define BALANCE_P2C 1			/* power of two random choices */
 
 typedef struct
 {
@@ -40,6 +83,9 @@ typedef struct
 	char path[MAXLINE];
 	char version[MAXLINE];
 	struct request_header *root;
+	struct route *route;		/* reverse-proxy route, NULL in forward mode */
+	int originfd;				/* speculative origin connect in flight, or -1 */
+	double connect_started;
 } request_line;
 
 typedef struct request_header
@@ -49,38 +95,206 @@ typedef struct request_header
 	struct request_header* next_header;
 } request_header;
 
-typedef struct cache_line
+/*
+ * Bytes of the origin response held by the proxy for one connection.
+ * Origin reads pause once hiwat bytes are waiting for the client and
+ * resume when the client has drained them down to lowat.
+ */
+typedef struct
 {
-	char hostname[MAXLINE];
-	char path[MAXLINE];
-	unsigned long size;
-	char *data;
-	int lru_counter;
-	struct cache_line* next_line;
-} cache_line;
+	size_t hiwat;
+	size_t lowat;
+} relay_watermark;
+
+/*
+ * What the origin's status line and headers say about its response,
+ * filled in by parse_response as the bytes arrive.
+ */
+typedef struct
+{
+	int status;				/* 0 if the status line was malformed */
+	long content_length;	/* -1 if absent */
+	int chunked;			/* Transfer-Encoding: chunked */
+	int no_store;			/* Cache-Control: no-store or private */
+	int no_cache;			/* Cache-Control: no-cache */
+	long max_age;			/* Cache-Control: s-maxage, else max-age; -1 if absent */
+	long stale_while_revalidate;	/* Cache-Control grace periods, -1 if absent */
+	long stale_if_error;
+	int must_revalidate;	/* Cache-Control: must-revalidate or proxy-revalidate */
+	time_t expires;			/* -1 if absent, 0 if unparsable */
+	char etag[RESPONSE_TAG];	/* empty if absent or too long */
+	char last_modified[RESPONSE_TAG];
+	int vary;				/* the response varies on request headers */
+	size_t parsed;			/* bytes of complete lines consumed so far */
+	size_t header_len;		/* through the blank line, 0 until it arrives */
+} response_info;
+
+typedef struct
+{
+	int srcfd;				/* origin, closed by the relay at EOF */
+	int dstfd;				/* client */
+	char *buf;
+	size_t cap;
+	size_t start;			/* first byte not yet written to the client */
+	size_t end;				/* one past the last byte read from the origin */
+	size_t total;			/* bytes read from the origin so far */
+	double first_byte;		/* now_ms() when the first origin byte arrived */
+	int keep;				/* buf still holds the whole response (cache candidate) */
+	int spill;				/* store-and-forward: ignore hiwat while keep is set */
+	response_info resp;		/* origin status and headers, parsed from buf */
+	cache_line *fill;		/* reserved cache entry buf points into, or NULL */
+	char *hostname;			/* cache key of the response */
+	char *path;
+	relay_watermark *wm;
+} relay_stream;
+
+typedef enum
+{
+	CIRCUIT_CLOSED,			/* requests flow, outcomes are recorded */
+	CIRCUIT_OPEN,			/* requests fail fast with 502 */
+	CIRCUIT_HALF_OPEN		/* a few probes decide whether to close again */
+} circuit_state;
+
+typedef struct origin_health
+{
+	char *key;				/* "host:port" */
+	circuit_state state;
+	unsigned char outcome[HEALTH_WINDOW];	/* ring, 1 = failure */
+	int next;
+	int samples;
+	int failures;
+	double latency_ms;		/* EWMA of connect to first response byte */
+	double opened_at;
+	double probed_at;		/* when the current half-open trial began */
+	int probes;				/* admitted in the current half-open trial */
+	unsigned int trial;		/* counts half-open periods, see admit_origin */
+	struct origin_health* next_origin;
+} origin_health;
+
+typedef struct backend
+{
+	char *host;
+	char *port;
+	int outstanding;		/* requests currently sent to this backend */
+	origin_health *health;
+} backend;
+
+/*
+ * One line of the routing table: requests whose Host matches host ("*"
+ * matches any) and whose path starts with prefix go to one of backends.
+ */
+typedef struct route
+{
+	char *host;
+	char *prefix;
+	size_t prefix_len;
+	int balance;
+	backend **backends;
+	int nbackends;
+	struct route* next_route;
+} route;
+
+/*
+ * TCP options for one side of the proxy (listener, client or origin).
+ * Zero leaves the kernel default in place.
+ */
+typedef struct
+{
+	int nodelay;			/* TCP_NODELAY */
+	int cork;				/* TCP_CORK around each response/request write */
+	int fastopen;			/* listener: TFO queue length, origin: TCP_FASTOPEN_CONNECT */
+	int sndbuf;				/* SO_SNDBUF */
+	int rcvbuf;				/* SO_RCVBUF */
+	int notsent_lowat;		/* TCP_NOTSENT_LOWAT */
+} sock_profile;
+
+/* A background revalidation of a stale copy already served to a client */
+typedef struct
+{
+	request_line request;	/* without its headers, request_buf has them */
+	char request_buf[MAXLINE * 2];
+	cache_line *stale;		/* referenced until the refresh is done */
+} refresh_job;
 
 static const char *user_agent_hdr = "Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3";
-cache_line* cache_root;
-size_t cache_size = 0;
+
+relay_watermark downstream_wm = { RELAY_HIWAT, RELAY_LOWAT };
+int relay_spill = 0;
+
+origin_health *health_table[HEALTH_BUCKETS];
+pthread_mutex_t health_lock = PTHREAD_MUTEX_INITIALIZER;
+double health_fail_ratio = HEALTH_FAIL_RATIO;
+double health_open_secs = HEALTH_OPEN_SECS;
+
+long stale_while_revalidate = STALE_WHILE_REVALIDATE;
+long stale_if_error = STALE_IF_ERROR;
+
+route *route_root = NULL;		/* non-NULL puts the proxy in reverse mode */
+
+char *snapshot_file = NULL;		/* -p: warm restarts from this cache snapshot */
+volatile sig_atomic_t stopping = 0;	/* SIGTERM or SIGINT arrived */
+
+sock_profile listen_profile, client_profile, origin_profile;
 
 void *run_thread(void*);
+void *refresh_thread(void*);
+void *snapshot_thread(void*);
+void stop_handler(int);
 
 void parse_request(request_line*, char*);
 void send_request(int, request_line*);
+int connect_origin(request_line*, backend**, origin_health**, unsigned int*, double*, char**);
+int send_origin(int, char*);
+void init_relay(relay_stream*, int, int, request_line*);
+void finish_relay(relay_stream*, int);
+int relay(relay_stream*);
+void size_relay(relay_stream*);
+int relay_headers(relay_stream*);
+void serve_cache(int, cache_line*);
+int sendfile_all(int, int, off_t, size_t);
+int sendmsg_all(int, struct iovec*, int, int);
+int serve_disk(int, request_line*);
+void refresh_stale(cache_line*, response_info*);
+int stale_usable(cache_line*, int);
+int serve_stale(int, cache_line*);
+void refresh_async(request_line*, char*, cache_line*);
+void client_error(int, char*, char*, char*);
+
+double now_ms();
+origin_health *search_health(char*, char*);
+int admit_origin(origin_health*, unsigned int*);
+void report_origin(origin_health*, unsigned int, int, double);
+void abandon_origin(origin_health*, unsigned int);
+void advance_circuit(origin_health*);
+int origin_available(origin_health*);
+
+void parse_profile(sock_profile*, char*);
+void apply_profile(int, sock_profile*);
+void cork_socket(int, sock_profile*, int);
+int open_listener(char*, sock_profile*);
+int open_origin(char*, char*, sock_profile*);
+int open_origin_start(char*, char*, sock_profile*);
+int open_origin_finish(int);
+void speculate_origin(request_line*);
+
+void load_routes(char*);
+route *search_route(request_line*);
+backend *choose_backend(route*);
+void release_backend(backend*);
 
 void modify_header(request_line*);
 void parse_header(request_line*, char*);
 // void create_header(request_line*, char*);
+int parse_response(response_info*, char*, size_t);
+void parse_response_header(response_info*, char*, char*);
+time_t parse_http_date(char*);
+int response_cacheable(response_info*);
+time_t response_expiry(response_info*, time_t);
+int add_validators(char*, size_t, cache_line*);
+int response_complete(response_info*, char*, size_t);
 void insert_header(request_line*, request_header*);
 request_header *search_header(request_line*, char*);
 
-void initialize_cache();
-// void insert_cache(request_line*, char*, size_t);
-void update_cache(cache_line*);
-void destruct_cache();
-void evict_cache();
-cache_line *create_cache();
-cache_line *search_cache(char*, char*);
 
 
 int main(int argc, char **argv) 
@@ -90,25 +304,126 @@ int main(int argc, char **argv)
 	/* establish listening requests */
 	/* when a client connects spawn a new thread to handle it */
 	struct sockaddr_in clientaddr;
+	struct sigaction stop;
+	sigset_t stop_mask, run_mask;
+	fd_set ready;
 	pthread_t tid;
 
-	int listenfd, *connfd;
+	int listenfd, *connfd, fd, opt, n;
 	unsigned int clientlen;
 
-	if (argc != 2) {
-		fprintf(stderr, "usage: %s <port>\n", argv[0]);
+	while ((opt = getopt(argc, argv, "w:sc:r:L:C:O:e:g:d:p:m")) != -1) {
+		switch (opt) {
+		case 'w':	/* -w hiwat:lowat */
+			if (sscanf(optarg, "%zu:%zu", &downstream_wm.hiwat, &downstream_wm.lowat) != 2
+				|| downstream_wm.hiwat == 0 || downstream_wm.hiwat > MAX_OBJECT_SIZE
+				|| downstream_wm.lowat >= downstream_wm.hiwat) {
+				fprintf(stderr, "bad watermarks '%s' (want hiwat:lowat, lowat < hiwat <= %d)\n",
+					optarg, MAX_OBJECT_SIZE);
+				exit(1);
+			}
+			break;
+		case 's':
+			relay_spill = 1;
+			break;
+		case 'c':	/* -c fail_ratio:open_secs */
+			if (sscanf(optarg, "%lf:%lf", &health_fail_ratio, &health_open_secs) != 2
+				|| health_fail_ratio <= 0 || health_fail_ratio > 1 || health_open_secs < 0) {
+				fprintf(stderr, "bad circuit breaker '%s' (want ratio:secs, 0 < ratio <= 1)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'r':
+			load_routes(optarg);
+			break;
+		case 'L':
+			parse_profile(&listen_profile, optarg);
+			break;
+		case 'C':
+			parse_profile(&client_profile, optarg);
+			break;
+		case 'O':
+			parse_profile(&origin_profile, optarg);
+			break;
+		case 'e':
+			if (set_cache_policy(optarg) < 0) {
+				fprintf(stderr, "unknown cache policy '%s' (want lru, clock, tinylfu, gdsf or gdsf-bytes)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'g':	/* -g revalidate_secs:error_secs */
+			if (sscanf(optarg, "%ld:%ld", &stale_while_revalidate, &stale_if_error) != 2
+				|| stale_while_revalidate < 0 || stale_if_error < 0) {
+				fprintf(stderr, "bad stale grace '%s' (want revalidate_secs:error_secs)\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'p':
+			snapshot_file = optarg;
+			break;
+		case 'm':	/* cache in a memfd, hits go out with sendfile */
+			cache_memfd = 1;
+			break;
+		case 'd':	/* -d dir: disk tier, e.g. on a tmpfs */
+			if (disk_init(optarg) < 0) {
+				fprintf(stderr, "cannot use '%s' for the disk tier: %s\n", optarg, strerror(errno));
+				exit(1);
+			}
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (argc - optind != 1) {
+usage:
+		fprintf(stderr, "usage: %s [-w hiwat:lowat] [-s] [-c fail_ratio:open_secs] [-r routes] [-e policy]\n"
+			"\t[-g revalidate_secs:error_secs] [-d disk_dir] [-p snapshot_file] [-m]\n"
+			"\t[-L|-C|-O nodelay,cork,fastopen[=qlen],sndbuf=N,rcvbuf=N,lowat=N] <port>\n", argv[0]);
 		exit(1);
 	}
 
 	Signal(SIGPIPE, SIG_IGN);   /* Ignore SIGPIPE */
+
+	//SIGTERM and SIGINT stop the accept loop below, and only it: every
+	//other thread inherits them blocked, pselect unblocks them for main
+	memset(&stop, 0, sizeof(stop));
+	stop.sa_handler = stop_handler;		/* no SA_RESTART: pselect must see EINTR */
+	sigemptyset(&stop.sa_mask);
+	sigaction(SIGTERM, &stop, NULL);
+	sigaction(SIGINT, &stop, NULL);
+	sigemptyset(&stop_mask);
+	sigaddset(&stop_mask, SIGTERM);
+	sigaddset(&stop_mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &stop_mask, &run_mask);
 	
-	initialize_cache();			/* Intialize cache (linked list) */
+	//expired objects stay as long as they may still be served stale
+	cache_grace = stale_while_revalidate > stale_if_error ? stale_while_revalidate : stale_if_error;
+	initialize_cache();			/* Intialize cache (sharded hash + LRU lists) */
+	if (snapshot_file) {
+		if ((n = load_cache(snapshot_file)) >= 0)
+			printf("loaded %d objects from %s\n", n, snapshot_file);
+		Pthread_create(&tid, NULL, snapshot_thread, NULL);
+	}
 
-	listenfd = Open_listenfd(argv[1]); //Open_listenfd => socket(), bind(), listen()
-	while (1) {
+	listenfd = open_listener(argv[optind], &listen_profile); // socket(), options, bind(), listen()
+	if (listenfd < 0)
+		unix_error("open_listener error");
+	while (!stopping) {
+		FD_ZERO(&ready);
+		FD_SET(listenfd, &ready);
+		if (pselect(listenfd + 1, &ready, NULL, NULL, NULL, &run_mask) < 0) {
+			if (errno != EINTR)
+				unix_error("pselect error");
+			continue;
+		}
 		clientlen = sizeof(clientaddr);
+		if ((fd = accept(listenfd, (SA *) &clientaddr, &clientlen)) < 0) { //typedef struct sockaddr SA;
+			if (errno != EINTR && errno != ECONNABORTED)
+				unix_error("Accept error");
+			continue;
+		}
 		connfd = Malloc(sizeof(int));
-		*connfd = Accept(listenfd, (SA *) &clientaddr, &clientlen); //typedef struct sockaddr SA;
+		*connfd = fd;
 
 		// char port[MAXLINE], hostname[MAXLINE];
 		// Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, port, MAXLINE, 0);
@@ -116,10 +431,35 @@ int main(int argc, char **argv)
 
 		Pthread_create(&tid, NULL, run_thread, connfd);
 	}
-	destruct_cache();
+
+	//threads still serving may be using the cache, so it is saved, not destructed
+	Close(listenfd);
+	if (snapshot_file) {
+		if ((n = save_cache(snapshot_file)) >= 0)
+			printf("saved %d objects to %s\n", n, snapshot_file);
+		else
+			fprintf(stderr, "cannot write snapshot %s: %s\n", snapshot_file, strerror(errno));
+	}
 	return 0;
 }
 
+void stop_handler(int sig)
+{
+	stopping = 1;
+}
+
+/* snapshot_thread - background writer: save the cache every SNAPSHOT_INTERVAL seconds */
+void *snapshot_thread(void *vargp)
+{
+	Pthread_detach(pthread_self());
+	while (1) {
+		sleep(SNAPSHOT_INTERVAL);
+		if (save_cache(snapshot_file) < 0)
+			fprintf(stderr, "cannot write snapshot %s: %s\n", snapshot_file, strerror(errno));
+	}
+	return NULL;
+}
+
 void *run_thread(void* vargp)
 {
 	rio_t rio;
@@ -128,14 +468,18 @@ void *run_thread(void* vargp)
 	int connfd = *((int*)vargp);
 	free(vargp);
 	Pthread_detach(pthread_self());
+	apply_profile(connfd, &client_profile);
 
 	request_line *request = Malloc(sizeof(request_line));
 	request->root = NULL;
+	request->route = NULL;
+	request->originfd = -1;
 
 	Rio_readinitb(&rio, connfd);
 	Rio_readlineb(&rio, buf, MAXLINE);
 	parse_request(request, buf);
 	memset(&buf[0], 0, sizeof(buf));
+	speculate_origin(request);	/* overlap DNS + handshake with the header read */
 
 	Rio_readlineb(&rio, buf, MAXLINE);
 	while(strcmp(buf, "\r\n")) {
@@ -144,9 +488,24 @@ void *run_thread(void* vargp)
 		Rio_readlineb(&rio, buf, MAXLINE);
 	}
 	memset(&buf[0], 0, sizeof(buf));
+
+	if (route_root && !(request->route = search_route(request))) {
+		client_error(connfd, "404", "Not Found", "No route for this host and path");
+		goto fail;
+	}
+	if (!request->hostname[0]) {
+		client_error(connfd, "400", "Bad Request", "Proxy requests need an absolute URI");
+		goto fail;
+	}
 	modify_header(request);
 	send_request(connfd, request);
 	return NULL;
+
+fail:
+	if (request->originfd >= 0)
+		Close(request->originfd);
+	Close(connfd);
+	return NULL;
 }
 
 /* Parsing Functions */
@@ -166,7 +525,10 @@ void parse_request(request_line *request, char* buf)
 	// URL to hostname && path
 	host_start = strstr(uri, "http://");
 	if(!host_start) {
-		//no hostname
+		//no hostname (origin-form), reverse mode fills it in from Host
+		request->hostname[0] = '\0';
+		strcpy(request->port, "80");
+		strcpy(request->path, uri);
 		return;
 	}
 	host_start += 7;
@@ -212,6 +574,7 @@ void create_request(request_line *request, char *request_buf)
 {
 	request_header* header;
 
+	request_buf[0] = '\0';
 	strcat(request_buf, request->method);
 	strcat(request_buf, " ");
 	strcat(request_buf, request->path);
@@ -231,69 +594,1047 @@ void create_request(request_line *request, char *request_buf)
 	printf("%s\r\n", request_buf);
 }
 
+/*
+ * parse_response - feed the first len bytes of the origin's response to
+ * the parser, which resumes after the last complete line it consumed.
+ * Returns 1 once the blank line ending the headers has been seen.
+ */
+int parse_response(response_info *info, char *buf, size_t len)
+{
+	char *line, *eol, *colon, *end;
+
+	if (info->parsed == 0) {
+		memset(info, 0, sizeof(*info));
+		info->content_length = -1;
+		info->max_age = -1;
+		info->expires = -1;
+		info->stale_while_revalidate = -1;
+		info->stale_if_error = -1;
+	}
+	if (info->header_len)
+		return 1;
+
+	while ((eol = memchr(buf + info->parsed, '\n', len - info->parsed))) {
+		line = buf + info->parsed;
+		end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+		info->parsed = eol + 1 - buf;
+
+		if (line == buf) {					/* status line */
+			if (sscanf(line, "HTTP/%*d.%*d %d", &info->status) != 1)
+				info->status = 0;
+		} else if (end == line) {			/* blank line */
+			info->header_len = info->parsed;
+			return 1;
+		} else if ((colon = memchr(line, ':', end - line))) {
+			char name[MAXLINE], value[MAXLINE];
+
+			snprintf(name, sizeof(name), "%.*s", (int)(colon - line), line);
+			for (colon++; colon < end && (*colon == ' ' || *colon == '\t'); colon++)
+				;
+			snprintf(value, sizeof(value), "%.*s", (int)(end - colon), colon);
+			parse_response_header(info, name, value);
+		}
+	}
+	return 0;
+}
+
+/* parse_response_header - record one header that matters to the cache */
+void parse_response_header(response_info *info, char *name, char *value)
+{
+	char *tok, *save;
+
+	if (strcasecmp(name, "Content-Length") == 0)
+		info->content_length = strtol(value, NULL, 10);
+	else if (strcasecmp(name, "Transfer-Encoding") == 0) {
+		for (tok = strtok_r(value, ", \t", &save); tok; tok = strtok_r(NULL, ", \t", &save))
+			info->chunked = strcasecmp(tok, "chunked") == 0;	/* the last coding */
+	} else if (strcasecmp(name, "Expires") == 0)
+		info->expires = parse_http_date(value);
+	else if (strcasecmp(name, "ETag") == 0) {
+		if (strlen(value) < RESPONSE_TAG)
+			strcpy(info->etag, value);
+	} else if (strcasecmp(name, "Last-Modified") == 0) {
+		if (strlen(value) < RESPONSE_TAG)
+			strcpy(info->last_modified, value);
+	} else if (strcasecmp(name, "Vary") == 0)
+		info->vary = value[0] != '\0';
+	else if (strcasecmp(name, "Cache-Control") == 0) {
+		for (tok = strtok_r(value, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+			while (*tok == ' ' || *tok == '\t')
+				tok++;
+			if (strncasecmp(tok, "no-store", 8) == 0 || strncasecmp(tok, "private", 7) == 0)
+				info->no_store = 1;
+			else if (strncasecmp(tok, "no-cache", 8) == 0)
+				info->no_cache = 1;
+			else if (strncasecmp(tok, "must-revalidate", 15) == 0
+				|| strncasecmp(tok, "proxy-revalidate", 16) == 0)
+				info->must_revalidate = 1;
+			else if (strncasecmp(tok, "stale-while-revalidate=", 23) == 0)
+				info->stale_while_revalidate = strtol(tok + 23, NULL, 10);
+			else if (strncasecmp(tok, "stale-if-error=", 15) == 0)
+				info->stale_if_error = strtol(tok + 15, NULL, 10);
+			else if (strncasecmp(tok, "s-maxage=", 9) == 0)
+				info->max_age = strtol(tok + 9, NULL, 10);
+			else if (strncasecmp(tok, "max-age=", 8) == 0 && info->max_age < 0)
+				info->max_age = strtol(tok + 8, NULL, 10);
+		}
+	}
+}
+
+/* parse_http_date - "Sun, 06 Nov 1994 08:49:37 GMT" to a time, 0 if invalid */
+time_t parse_http_date(char *value)
+{
+	static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	char month[4];
+	char *m;
+	struct tm tm;
+
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(value, "%*3s, %d %3s %d %d:%d:%d GMT", &tm.tm_mday, month,
+			&tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6)
+		return 0;
+	if (strlen(month) != 3 || !(m = strstr(months, month)) || (m - months) % 3)
+		return 0;
+	tm.tm_mon = (m - months) / 3;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+/*
+ * response_cacheable - whether a response may be stored at all: a
+ * successful status, nothing forbidding a shared cache from keeping it,
+ * and not varying on request headers the cache key ignores. Error pages
+ * are left to the origin. no-cache responses are stored but come out of
+ * response_expiry already stale.
+ */
+int response_cacheable(response_info *info)
+{
+	if (info->status != 200 && info->status != 203
+		&& info->status != 300 && info->status != 301)
+		return 0;
+	return !info->no_store && !info->vary;
+}
+
+/* response_expiry - when a response received at now stops being fresh */
+time_t response_expiry(response_info *info, time_t now)
+{
+	time_t modified;
+
+	if (info->no_cache)
+		return now;
+	if (info->max_age >= 0)
+		return now + info->max_age;
+	if (info->expires >= 0)		/* an invalid date means already expired */
+		return info->expires ? info->expires : now;
+	if (info->last_modified[0] && (modified = parse_http_date(info->last_modified))
+		&& modified < now) {
+		time_t lifetime = (now - modified) / 10;
+
+		return now + (lifetime < FRESH_HEURISTIC_MAX ? lifetime : FRESH_HEURISTIC_MAX);
+	}
+	return now + FRESH_DEFAULT;
+}
+
+/*
+ * add_validators - turn the request in request_buf (size bytes) into a
+ * conditional GET for the stale object, with the ETag and Last-Modified
+ * its stored headers carry. Returns 0 if it has neither.
+ */
+int add_validators(char *request_buf, size_t size, cache_line *stale)
+{
+	response_info stored;
+	size_t len = strlen(request_buf) - 2;	/* before the blank line */
+	int n = 0;
+
+	stored.parsed = 0;
+	if (!parse_response(&stored, cache_response(stale), cache_response_size(stale)))
+		return 0;
+	if (stored.etag[0])
+		n += snprintf(request_buf + len + n, size - len - n, "If-None-Match: %s\r\n", stored.etag);
+	if (stored.last_modified[0] && len + n < size)
+		n += snprintf(request_buf + len + n, size - len - n, "If-Modified-Since: %s\r\n", stored.last_modified);
+	if (n == 0 || len + n + 3 > size) {
+		strcpy(request_buf + len, "\r\n");	/* no validators or no room: plain GET */
+		return 0;
+	}
+	strcpy(request_buf + len + n, "\r\n");
+	return 1;
+}
+
+/*
+ * response_complete - whether the len bytes in buf are the whole response
+ * rather than one cut short by the origin: all of Content-Length, or the
+ * last chunk of a chunked body. Otherwise only EOF delimits the body.
+ */
+int response_complete(response_info *info, char *buf, size_t len)
+{
+	if (!info->header_len)
+		return 0;
+	if (info->chunked) {
+		size_t body = len - info->header_len;
+
+		if (body == 5)
+			return memcmp(buf + info->header_len, "0\r\n\r\n", 5) == 0;
+		return body > 5 && memcmp(buf + len - 7, "\r\n0\r\n\r\n", 7) == 0;
+	}
+	if (info->content_length >= 0)
+		return len == info->header_len + info->content_length;
+	return 1;
+}
+
 /* I/O Functions */
 void send_request(int connfd, request_line *request)
 {
 	char request_buf[MAXLINE * 2];
-	char response_buf[MAXLINE];
-	char cache_candidate[MAX_OBJECT_SIZE];
-	char *cache_ptr = cache_candidate;
-	
-	rio_t rio;
-	ssize_t len=0;
-	int cachable = 1;
-	int requestfd;
+	relay_stream rs;
+	backend *be = NULL;
+	origin_health *health;
+	unsigned int probe;
+	double started;
+	char *why;
+	int requestfd, rc, validators, conditional = 0, answered = 0;
 
 	create_request(request, request_buf);
+	validators = search_header(request, "If-None-Match") || search_header(request, "If-Modified-Since");
 	
-	cache_line* target= search_cache(request->path, request->hostname);
+	cache_line* target= search_cache(request->path, request->hostname), *stale = NULL;
+	if (target && !fresh_cache(target, 0) && !stale_usable(target, 0)) {
+		stale = target;			/* revalidate it first */
+		target = NULL;
+	}
 	if (target) {
-		Rio_writen(connfd, target->data, target->size);
-		update_cache(target);
+		serve_cache(connfd, target);
+		if (!fresh_cache(target, 0) && !validators) {
+			//stale-while-revalidate: the refresh takes over our speculation and reference
+			refresh_async(request, request_buf, target);
+			target = NULL;
+		}
+		if (request->originfd >= 0) {	/* speculation lost, nothing to pool it in */
+			Close(request->originfd);
+			request->originfd = -1;
+		}
+		if (target)
+			release_cache(target);
 		Close(connfd);
 		return;
   	}
+	if (!stale && serve_disk(connfd, request)) {
+		if (request->originfd >= 0) {
+			Close(request->originfd);
+			request->originfd = -1;
+		}
+		Close(connfd);
+		return;
+	}
+	if (stale && !validators)	/* the client's own validators go through as they are */
+		conditional = add_validators(request_buf, sizeof(request_buf), stale);
 
-	//open request file descriptor
-	requestfd = Open_clientfd(request->hostname, request->port);
+	//open request file descriptor, failing fast while the origin is unhealthy
+	requestfd = connect_origin(request, &be, &health, &probe, &started, &why);
+	if (requestfd < 0) {
+		if (!serve_stale(connfd, stale))
+			client_error(connfd, "502", "Bad Gateway", why);
+		goto done;
+	}
 
 	//send request
-	Rio_writen(requestfd, request_buf, strlen(request_buf));
+	if (send_origin(requestfd, request_buf) < 0) {
+		report_origin(health, probe, 1, 0);
+		if (!serve_stale(connfd, stale))
+			client_error(connfd, "502", "Bad Gateway", "Could not send request to origin");
+		Close(requestfd);
+		goto done;
+	}
 	
-	//recieve response
-	Rio_readinitb(&rio, requestfd);
-	while((len = Rio_readnb(&rio, response_buf, MAXLINE)) > 0)
-	{
-		Rio_writen(connfd, response_buf, (size_t) len);
-		if (cachable) {
-			if ((len + (cache_ptr - cache_candidate)) <= MAX_OBJECT_SIZE) {
-				cache_ptr[0] = '\0';
-				strncat(cache_ptr, response_buf, len); 
-				cache_ptr += len;
-			} else cachable=0;
+	//relay response; the relay buffer doubles as the cache candidate. With
+	//a stale copy at hand the headers are held back until we know whether
+	//it is still good (304) or should stand in for a failing origin.
+	init_relay(&rs, requestfd, connfd, request);
+	rc = stale ? relay_headers(&rs) : 0;
+	if (rc == 0 && conditional && rs.resp.status == 304) {
+		refresh_stale(stale, &rs.resp);
+		serve_cache(connfd, stale);
+		answered = 1;
+		rs.keep = 0;			/* nothing new to store */
+	} else if ((rc < 0 || rs.resp.status >= 500) && serve_stale(connfd, stale)) {
+		answered = 1;
+		rs.keep = 0;
+	} else if (rc == 0) {
+		if (stale)
+			size_relay(&rs);
+		cork_socket(connfd, &client_profile, 1);
+		rc = relay(&rs);
+		cork_socket(connfd, &client_profile, 0);
+	}
+	if (rc != RELAY_CLIENT_ERR) {
+		int failed = (rc == RELAY_ORIGIN_ERR || rs.total == 0);
+		report_origin(health, probe, failed, failed ? 0 : rs.first_byte - started);
+		if (!answered && rs.total == 0)
+			client_error(connfd, "502", "Bad Gateway", "Origin sent an empty response");
+		else if (!answered && stale && !rs.resp.header_len)
+			client_error(connfd, "502", "Bad Gateway", "Origin response ended in its headers");
+	} else
+		abandon_origin(health, probe);
+	Close(connfd);			/* the client has it all; storing it is our business */
+	connfd = -1;
+	finish_relay(&rs, rc);
+done:
+	if (request->originfd >= 0)
+		Close(request->originfd);
+	if (be)
+		release_backend(be);
+	if (stale)
+		release_cache(stale);
+	if (connfd >= 0)
+		Close(connfd);
+}
+
+/*
+ * connect_origin - connect to the origin of a request, or to a backend of
+ * its route, finishing the speculative connect if one is in flight, and
+ * failing fast while the origin's circuit is open. Returns the socket, or
+ * -1 with *why set for the client; *probe is for report_origin.
+ */
+int connect_origin(request_line *request, backend **be, origin_health **health, unsigned int *probe,
+	double *started, char **why)
+{
+	char *host = request->hostname, *port = request->port;
+	int requestfd;
+
+	if (request->route) {
+		*be = choose_backend(request->route);
+		host = (*be)->host;
+		port = (*be)->port;
+		*health = (*be)->health;
+	} else
+		*health = search_health(host, port);
+	if (!admit_origin(*health, probe)) {
+		*why = "Origin is unavailable (circuit open)";
+		return -1;
+	}
+	*started = now_ms();
+	if (request->originfd >= 0) {
+		*started = request->connect_started;
+		requestfd = open_origin_finish(request->originfd);
+		request->originfd = -1;
+		if (requestfd < 0)	/* retry the slow way, walking every address */
+			requestfd = open_origin(host, port, &origin_profile);
+	} else
+		requestfd = open_origin(host, port, &origin_profile);
+	if (requestfd < 0) {
+		report_origin(*health, *probe, 1, 0);
+		*why = "Could not connect to origin";
+	}
+	return requestfd;
+}
+
+/* send_origin - write the whole request in one corked burst */
+int send_origin(int requestfd, char *request_buf)
+{
+	int rc;
+
+	cork_socket(requestfd, &origin_profile, 1);
+	rc = rio_writen(requestfd, request_buf, strlen(request_buf));
+	cork_socket(requestfd, &origin_profile, 0);
+	return rc;
+}
+
+/* init_relay - set up a relay from the origin to the client (-1: none) */
+void init_relay(relay_stream *rs, int srcfd, int dstfd, request_line *request)
+{
+	rs->srcfd = srcfd;
+	rs->dstfd = dstfd;
+	rs->cap = RELAY_STAGING;
+	rs->buf = Malloc(rs->cap);
+	rs->start = rs->end = rs->total = 0;
+	rs->keep = 1;
+	rs->spill = relay_spill;
+	memset(&rs->resp, 0, sizeof(rs->resp));
+	rs->fill = NULL;
+	rs->hostname = request->hostname;
+	rs->path = request->path;
+	rs->wm = &downstream_wm;
+}
+
+/*
+ * finish_relay - store the response if it is complete and still kept
+ * (the maintenance thread inserts it), then release the relay's buffer
+ * and origin
+ */
+void finish_relay(relay_stream *rs, int rc)
+{
+	if (rs->fill) {			/* filled in place, complete only at Content-Length */
+		if (rc == 0 && rs->keep && rs->total == rs->fill->size)
+			commit_cache(rs->fill);
+		else
+			abandon_cache(rs->fill);
+	} else {
+		if (rc == 0 && rs->keep && response_complete(&rs->resp, rs->buf, rs->total))
+			insert_cache(rs->hostname, rs->path, rs->buf, rs->total,
+				response_expiry(&rs->resp, time(NULL)));
+		Free(rs->buf);
+	}
+	if (rs->srcfd >= 0)
+		Close(rs->srcfd);
+}
+
+/*
+ * serve_cache - send a cached response to the client: its pre-rendered
+ * headers, an Age line and the body in one gathered write. With the cache
+ * in a memfd (-m) the body of an object with pages of its own (see
+ * slab_file) is sent with sendfile from its place there instead, behind
+ * the headers held back with MSG_MORE, so the kernel takes its pages
+ * without copying them through us. A response stored
+ * without a complete header block goes out as it is.
+ */
+void serve_cache(int connfd, cache_line *line)
+{
+	struct iovec iov[3];
+	char age[64];
+	off_t offset;
+	long secs = time(NULL) - __atomic_load_n(&line->fetched, __ATOMIC_RELAXED);
+	int fd = slab_file(cache_data(line), &offset);
+
+	iov[0].iov_base = cache_response(line);
+	iov[0].iov_len = line->head_len;
+	iov[1].iov_base = age;
+	iov[1].iov_len = snprintf(age, sizeof(age), "Age: %ld\r\n\r\n", secs > 0 ? secs : 0);
+	iov[2].iov_base = cache_body(line);
+	iov[2].iov_len = cache_body_size(line);
+	if (!line->head_len) {
+		iov[0].iov_len = iov[1].iov_len = 0;
+		iov[2].iov_base = cache_response(line);
+		iov[2].iov_len = cache_response_size(line);
+	}
+
+	cork_socket(connfd, &client_profile, 1);
+	if (fd < 0)
+		sendmsg_all(connfd, iov, 3, 0);
+	else if (sendmsg_all(connfd, iov, 2, MSG_MORE) == 0)
+		sendfile_all(connfd, fd, offset + ((char*)iov[2].iov_base - cache_data(line)), iov[2].iov_len);
+	cork_socket(connfd, &client_profile, 0);
+}
+
+/* sendmsg_all - write all of iov (flags as for sendmsg), like rio_writen */
+int sendmsg_all(int fd, struct iovec *iov, int iovcnt, int flags)
+{
+	struct msghdr msg;
+	ssize_t n;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = iovcnt;
+	while (msg.msg_iovlen > 0) {
+		if (msg.msg_iov->iov_len == 0) {
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+			continue;
 		}
-  	}
-	if (cachable) {
-		int size = cache_ptr - cache_candidate;
-		if ((cache_size + size) >  MAX_CACHE_SIZE)
-			while ((cache_size + size) > MAX_CACHE_SIZE)
-				evict_cache();
-		
-		cache_line *new_line = create_cache();
-
-		strcpy(new_line->hostname, request->hostname);
-		strcpy(new_line->path, request->path);
-		new_line->size = size;
-		new_line->data = Malloc(size);
-		new_line->data[0] = '\0';
-		strncat(new_line->data, cache_candidate, size);
-		
-		cache_size += size;
-		update_cache(new_line);
-	}
-
-	Close(requestfd);
-	Close(connfd);
+		if ((n = sendmsg(fd, &msg, flags | MSG_NOSIGNAL)) < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		while (n > 0 && (size_t)n >= msg.msg_iov->iov_len) {	/* skip what went out */
+			n -= msg.msg_iov->iov_len;
+			msg.msg_iov->iov_len = 0;
+			msg.msg_iov++;
+			msg.msg_iovlen--;
+		}
+		if (n > 0) {
+			msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + n;
+			msg.msg_iov->iov_len -= n;
+		}
+	}
+	return 0;
+}
+
+/* sendfile_all - send len bytes of infd from offset, like rio_writen */
+int sendfile_all(int outfd, int infd, off_t offset, size_t len)
+{
+	ssize_t n;
+
+	while (len > 0) {
+		if ((n = sendfile(outfd, infd, &offset, len)) <= 0) {
+			if (n < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		len -= n;
+	}
+	return 0;
+}
+
+/*
+ * serve_disk - answer with a fresh object search_cache could not bring
+ * back from the disk tier (too big for memory, or no chunk free for it),
+ * read from its segment a relay buffer at a time. Returns 0 if there is
+ * none (or its first read fails).
+ */
+int serve_disk(int connfd, request_line *request)
+{
+	disk_object obj;
+	size_t pos;
+	ssize_t n = 0;
+	char *buf;
+
+	if (!disk_open(request->hostname, request->path, hash_key(request->hostname, request->path), &obj))
+		return 0;
+	if (obj.expires <= time(NULL)) {
+		disk_close(&obj);
+		return 0;
+	}
+	buf = Malloc(RELAY_HIWAT);
+	cork_socket(connfd, &client_profile, 1);
+	for (pos = 0; pos < obj.size; pos += n)
+		if ((n = disk_read(&obj, buf, RELAY_HIWAT, pos)) <= 0 || rio_writen(connfd, buf, n) < 0)
+			break;
+	cork_socket(connfd, &client_profile, 0);
+	Free(buf);
+	disk_close(&obj);
+	return pos > 0;
+}
+
+/*
+ * stale_usable - whether a stale copy may still stand in for the origin:
+ * while it is revalidated in the background, or (on_error) when the
+ * origin fails. The stored response's stale-while-revalidate and
+ * stale-if-error override the -g grace periods; must-revalidate and
+ * no-cache rule both out, and a response that expired on arrival
+ * (max-age=0 or an invalid Expires) gets no grace it did not ask for.
+ */
+int stale_usable(cache_line *stale, int on_error)
+{
+	response_info stored;
+	long grace = on_error ? stale_if_error : stale_while_revalidate;
+
+	stored.parsed = 0;
+	if (!parse_response(&stored, cache_response(stale), cache_response_size(stale))
+		|| stored.must_revalidate || stored.no_cache)
+		return 0;
+	if ((on_error ? stored.stale_if_error : stored.stale_while_revalidate) >= 0)
+		grace = on_error ? stored.stale_if_error : stored.stale_while_revalidate;
+	else if (stored.max_age == 0 || (stored.max_age < 0 && stored.expires == 0))
+		grace = 0;
+	return grace > 0 && fresh_cache(stale, grace);
+}
+
+/* serve_stale - stale-if-error: answer with the stale copy, if it may be */
+int serve_stale(int connfd, cache_line *stale)
+{
+	if (!stale || !stale_usable(stale, 1))
+		return 0;
+	serve_cache(connfd, stale);
+	return 1;
+}
+
+/*
+ * refresh_async - revalidate a stale copy in a background thread, unless
+ * one is already at it. Takes over the caller's reference on it and the
+ * request's speculative origin connect, if any.
+ */
+void refresh_async(request_line *request, char *request_buf, cache_line *stale)
+{
+	refresh_job *job;
+	pthread_t tid;
+
+	if (!start_refresh(stale)) {
+		release_cache(stale);
+		return;
+	}
+	job = Malloc(sizeof(refresh_job));
+	job->request = *request;
+	job->request.root = NULL;
+	request->originfd = -1;
+	strcpy(job->request_buf, request_buf);
+	add_validators(job->request_buf, sizeof(job->request_buf), stale);
+	job->stale = stale;
+	Pthread_create(&tid, NULL, refresh_thread, job);
+}
+
+/*
+ * refresh_thread - the origin's 304 makes the stale copy fresh again; a
+ * new cacheable response replaces it; failures leave it as it is.
+ */
+void *refresh_thread(void *vargp)
+{
+	refresh_job *job = vargp;
+	relay_stream rs;
+	backend *be = NULL;
+	origin_health *health;
+	unsigned int probe;
+	double started;
+	char *why;
+	int requestfd, rc;
+
+	Pthread_detach(pthread_self());
+	requestfd = connect_origin(&job->request, &be, &health, &probe, &started, &why);
+	if (requestfd >= 0 && send_origin(requestfd, job->request_buf) < 0) {
+		report_origin(health, probe, 1, 0);
+		Close(requestfd);
+		requestfd = -1;
+	}
+	if (requestfd >= 0) {
+		init_relay(&rs, requestfd, -1, &job->request);
+		rc = relay_headers(&rs);
+		if (rc == 0 && rs.resp.status == 304) {
+			refresh_stale(job->stale, &rs.resp);
+			rs.keep = 0;
+		} else if (rc == 0) {
+			size_relay(&rs);
+			if (rs.keep)	/* no client: only worth reading to fill the cache */
+				rc = relay(&rs);
+		}
+		int failed = (rc == RELAY_ORIGIN_ERR || rs.total == 0);
+		report_origin(health, probe, failed, failed ? 0 : rs.first_byte - started);
+		finish_relay(&rs, rc);
+	}
+	if (job->request.originfd >= 0)
+		Close(job->request.originfd);
+	if (be)
+		release_backend(be);
+	end_refresh(job->stale);
+	release_cache(job->stale);
+	Free(job);
+	return NULL;
+}
+
+/*
+ * refresh_stale - the origin answered 304 Not Modified for a stale copy:
+ * it is fresh again for the lifetime the 304 gives, or failing that for
+ * the one its own stored headers give.
+ */
+void refresh_stale(cache_line *stale, response_info *resp)
+{
+	response_info stored;
+
+	if (resp->max_age < 0 && resp->expires < 0 && !resp->no_cache) {
+		stored.parsed = 0;
+		parse_response(&stored, cache_response(stale), cache_response_size(stale));
+		resp = &stored;
+	}
+	refresh_cache(stale, response_expiry(resp, time(NULL)));
+}
+
+/*
+ * relay - move the origin response to the client without letting either
+ * side run the other. Origin reads stop while hiwat bytes are queued for a
+ * slow client and restart at lowat; the origin is closed as soon as it hits
+ * EOF, even if the client still has bytes to drain. While the response
+ * still fits in buf (keep), nothing is discarded so the caller can cache
+ * it; with spill set those bytes are read ahead regardless of hiwat, so
+ * cacheable objects free their origin connection at origin speed. buf
+ * starts as a small staging buffer and is replaced once the headers are
+ * in (see size_relay); a response filled into a cache entry is complete
+ * at its Content-Length, where the origin is closed without waiting for
+ * EOF. Without a client (dstfd < 0) the relay only fills buf.
+ * Returns 0 once everything was delivered, RELAY_ORIGIN_ERR or
+ * RELAY_CLIENT_ERR when that side failed.
+ */
+int relay(relay_stream *rs)
+{
+	struct pollfd pfd[2];
+	int flags, paused = 0, rc = 0;
+	ssize_t n;
+
+	if (rs->dstfd >= 0) {
+		flags = fcntl(rs->dstfd, F_GETFL);
+		fcntl(rs->dstfd, F_SETFL, flags | O_NONBLOCK);
+	}
+
+	while (rs->srcfd >= 0 || rs->end > rs->start) {
+		if (rs->dstfd < 0)
+			rs->start = rs->end;	/* no client, nothing to deliver */
+		size_t queued = rs->end - rs->start;
+		int nfds = 0, src = -1, dst = -1;
+
+		if (rs->fill && rs->end == rs->cap && rs->srcfd >= 0) {
+			Close(rs->srcfd);	/* all of Content-Length is in */
+			rs->srcfd = -1;
+			continue;
+		}
+
+		if (paused && queued <= rs->wm->lowat)
+			paused = 0;
+		if (!(rs->spill && rs->keep) && queued >= rs->wm->hiwat)
+			paused = 1;
+
+		if (rs->srcfd >= 0 && !paused) {
+			pfd[nfds].fd = rs->srcfd;
+			pfd[nfds].events = POLLIN;
+			src = nfds++;
+		}
+		if (queued) {
+			pfd[nfds].fd = rs->dstfd;
+			pfd[nfds].events = POLLOUT;
+			dst = nfds++;
+		}
+		if (poll(pfd, nfds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			rc = RELAY_ORIGIN_ERR;
+			break;
+		}
+
+		if (src >= 0 && pfd[src].revents) {
+			size_t room;
+
+			if (!rs->fill && rs->end == rs->cap && rs->cap < MAX_OBJECT_SIZE) {
+				rs->cap = MAX_OBJECT_SIZE;	/* not sized (yet), grow the staging buffer */
+				rs->buf = Realloc(rs->buf, rs->cap);
+			} else if (!rs->fill && rs->keep && rs->end == rs->cap && disk_active
+				&& rs->cap < DISK_MAX_OBJECT) {
+				rs->cap = rs->cap * 2 < DISK_MAX_OBJECT ? rs->cap * 2 : DISK_MAX_OBJECT;
+				rs->buf = Realloc(rs->buf, rs->cap);	/* still a candidate for the disk tier */
+			}
+			if (rs->keep && rs->end == rs->cap)
+				rs->keep = 0;	/* too big to cache, fall back to streaming */
+			if (!rs->keep && rs->start) {
+				memmove(rs->buf, rs->buf + rs->start, queued);
+				rs->start = 0;
+				rs->end = queued;
+			}
+			room = rs->cap - rs->end;
+			if (!(rs->spill && rs->keep) && room > rs->wm->hiwat - queued)
+				room = rs->wm->hiwat - queued;
+
+			n = read(rs->srcfd, rs->buf + rs->end, room);
+			if (n < 0 && errno != EINTR) {
+				rc = RELAY_ORIGIN_ERR;
+				break;
+			}
+			if (n == 0) {
+				Close(rs->srcfd);	/* release the origin before the client drains */
+				rs->srcfd = -1;
+			}
+			if (n > 0) {
+				if (!rs->total)
+					rs->first_byte = now_ms();
+				rs->end += n;
+				rs->total += n;
+				if (rs->keep && !rs->resp.header_len)
+					size_relay(rs);
+			}
+		}
+
+		if (dst >= 0 && pfd[dst].revents) {
+			n = write(rs->dstfd, rs->buf + rs->start, rs->end - rs->start);
+			if (n < 0 && errno != EAGAIN && errno != EINTR) {
+				rc = RELAY_CLIENT_ERR;
+				break;
+			}
+			if (n > 0)
+				rs->start += n;
+		}
+	}
+
+	if (rs->dstfd >= 0)
+		fcntl(rs->dstfd, F_SETFL, flags);
+	return rc;
+}
+
+/*
+ * size_relay - once the origin's headers are in, decide whether the
+ * response is worth keeping at all, and move one with a Content-Length
+ * into a cache entry of exactly its size, so the rest of the body is read
+ * straight into its final place and binary bodies are kept byte for
+ * byte. Uncacheable and oversize responses stop being kept before
+ * anything else is copied; without a length, or too big for memory but
+ * not for the disk tier, the buffer grows as needed and the response is
+ * copied into the cache at the end.
+ */
+void size_relay(relay_stream *rs)
+{
+	response_info *resp = &rs->resp;
+	size_t size;
+	cache_line *fill;
+
+	if (!parse_response(resp, rs->buf, rs->end))
+		return;				/* headers still incomplete */
+	if (!response_cacheable(resp)) {
+		rs->keep = 0;
+		return;
+	}
+	if (resp->chunked || resp->content_length < 0)
+		return;
+	size = resp->header_len + resp->content_length;
+	if (size > (disk_active ? DISK_MAX_OBJECT : MAX_OBJECT_SIZE) || size < rs->end) {
+		rs->keep = 0;		/* too big, or more than the origin announced */
+		return;
+	}
+	if (size > MAX_OBJECT_SIZE)
+		return;				/* kept in buf for the disk tier */
+	if (!(fill = reserve_cache(rs->hostname, rs->path, size, response_expiry(resp, time(NULL)))))
+		return;
+	memcpy(cache_data(fill), rs->buf, rs->end);
+	Free(rs->buf);
+	rs->buf = cache_data(fill);
+	rs->cap = fill->size;
+	rs->fill = fill;
+}
+
+/*
+ * relay_headers - read the origin's status line and headers into buf
+ * without passing anything on, for callers that act on the status first;
+ * relay then starts with them queued. Returns 0 once they are in, or
+ * RELAY_ORIGIN_ERR if the origin failed or closed before that.
+ */
+int relay_headers(relay_stream *rs)
+{
+	ssize_t n;
+
+	while (!parse_response(&rs->resp, rs->buf, rs->end)) {
+		if (rs->end == rs->cap) {
+			if (rs->cap >= MAX_OBJECT_SIZE)
+				return RELAY_ORIGIN_ERR;
+			rs->cap = MAX_OBJECT_SIZE;
+			rs->buf = Realloc(rs->buf, rs->cap);
+		}
+		n = read(rs->srcfd, rs->buf + rs->end, rs->cap - rs->end);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return RELAY_ORIGIN_ERR;
+		if (!rs->total)
+			rs->first_byte = now_ms();
+		rs->end += n;
+		rs->total += n;
+	}
+	return 0;
+}
+
+/* Socket Option Functions */
+
+/* parse_profile - fill a profile from "nodelay,cork,fastopen=16,sndbuf=65536,..." */
+void parse_profile(sock_profile *prof, char *spec)
+{
+	char buf[MAXLINE], *tok, *save, *eq;
+	int val;
+
+	snprintf(buf, sizeof(buf), "%s", spec);
+	for (tok = strtok_r(buf, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+		val = 1;
+		if ((eq = strchr(tok, '='))) {
+			*eq = '\0';
+			val = atoi(eq + 1);
+			if (val <= 0)
+				goto bad;
+		}
+		if (strcmp(tok, "nodelay") == 0)
+			prof->nodelay = val;
+		else if (strcmp(tok, "cork") == 0)
+			prof->cork = val;
+		else if (strcmp(tok, "fastopen") == 0)
+			prof->fastopen = eq ? val : 16;
+		else if (strcmp(tok, "sndbuf") == 0 && eq)
+			prof->sndbuf = val;
+		else if (strcmp(tok, "rcvbuf") == 0 && eq)
+			prof->rcvbuf = val;
+		else if (strcmp(tok, "lowat") == 0 && eq)
+			prof->notsent_lowat = val;
+		else
+			goto bad;
+	}
+	return;
+bad:
+	fprintf(stderr, "bad socket profile '%s'\n", spec);
+	exit(1);
+}
+
+/*
+ * apply_profile - set the options that work on any TCP socket. Buffer
+ * sizes must be set before connect()/listen() to affect window scaling,
+ * so open_listener and open_origin call this on the fresh socket.
+ */
+void apply_profile(int fd, sock_profile *prof)
+{
+	if (prof->nodelay)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &prof->nodelay, sizeof(int));
+	if (prof->sndbuf)
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &prof->sndbuf, sizeof(int));
+	if (prof->rcvbuf)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &prof->rcvbuf, sizeof(int));
+	if (prof->notsent_lowat)
+		setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &prof->notsent_lowat, sizeof(int));
+}
+
+/*
+ * cork_socket - hold partial segments while a header and body are being
+ * written, and flush them as one when uncorked.
+ */
+void cork_socket(int fd, sock_profile *prof, int on)
+{
+	if (prof->cork)
+		setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+}
+
+/* open_listener - open_listenfd with the listener profile applied before listen() */
+int open_listener(char *port, sock_profile *prof)
+{
+	struct addrinfo hints, *listp, *p;
+	int listenfd, rc, optval = 1;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+	if ((rc = getaddrinfo(NULL, port, &hints, &listp)) != 0) {
+		fprintf(stderr, "getaddrinfo failed (port %s): %s\n", port, gai_strerror(rc));
+		return -2;
+	}
+
+	for (p = listp; p; p = p->ai_next) {
+		if ((listenfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(int));
+		apply_profile(listenfd, prof);
+		if (prof->fastopen)
+			setsockopt(listenfd, IPPROTO_TCP, TCP_FASTOPEN, &prof->fastopen, sizeof(int));
+		if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+			break;
+		close(listenfd);
+	}
+	freeaddrinfo(listp);
+	if (!p)
+		return -1;
+
+	if (listen(listenfd, LISTENQ) < 0) {
+		close(listenfd);
+		return -1;
+	}
+	return listenfd;
+}
+
+/*
+ * open_origin - open_clientfd with the origin profile applied before
+ * connect(). With fastopen, TCP_FASTOPEN_CONNECT defers the SYN to the
+ * first write so repeat connects carry the request in the handshake.
+ */
+int open_origin(char *hostname, char *port, sock_profile *prof)
+{
+	struct addrinfo hints, *listp, *p;
+	int clientfd, rc, optval = 1;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	if ((rc = getaddrinfo(hostname, port, &hints, &listp)) != 0) {
+		fprintf(stderr, "getaddrinfo failed (%s:%s): %s\n", hostname, port, gai_strerror(rc));
+		return -2;
+	}
+
+	for (p = listp; p; p = p->ai_next) {
+		if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		apply_profile(clientfd, prof);
+#ifdef TCP_FASTOPEN_CONNECT
+		if (prof->fastopen)
+			setsockopt(clientfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &optval, sizeof(int));
+#endif
+		if (connect(clientfd, p->ai_addr, p->ai_addrlen) != -1)
+			break;
+		close(clientfd);
+	}
+	freeaddrinfo(listp);
+	if (!p)
+		return -1;
+	return clientfd;
+}
+
+/*
+ * open_origin_start - resolve the origin and start a non-blocking connect
+ * to its first usable address. Returns the socket with the handshake in
+ * flight, or -1; open_origin_finish waits for the result.
+ */
+int open_origin_start(char *hostname, char *port, sock_profile *prof)
+{
+	struct addrinfo hints, *listp, *p;
+	int clientfd = -1, flags;
+
+	memset(&hints, 0, sizeof(struct addrinfo));
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+	if (getaddrinfo(hostname, port, &hints, &listp) != 0)
+		return -1;
+
+	for (p = listp; p; p = p->ai_next) {
+		if ((clientfd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) < 0)
+			continue;
+		apply_profile(clientfd, prof);
+		flags = fcntl(clientfd, F_GETFL);
+		fcntl(clientfd, F_SETFL, flags | O_NONBLOCK);
+		if (connect(clientfd, p->ai_addr, p->ai_addrlen) == 0 || errno == EINPROGRESS)
+			break;
+		close(clientfd);
+		clientfd = -1;
+	}
+	freeaddrinfo(listp);
+	return clientfd;
+}
+
+/* open_origin_finish - wait for a started connect; blocking fd or -1 */
+int open_origin_finish(int clientfd)
+{
+	struct pollfd pfd;
+	int err = 0, flags;
+	socklen_t len = sizeof(err);
+
+	pfd.fd = clientfd;
+	pfd.events = POLLOUT;
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR) {
+			err = errno;
+			break;
+		}
+	if (!err && getsockopt(clientfd, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err) {
+		close(clientfd);
+		return -1;
+	}
+	flags = fcntl(clientfd, F_GETFL);
+	fcntl(clientfd, F_SETFL, flags & ~O_NONBLOCK);
+	return clientfd;
+}
+
+/*
+ * speculate_origin - called as soon as the request line is parsed, while
+ * the client is still sending headers. Host and port are already known in
+ * forward mode, so the DNS lookup and TCP handshake can overlap with the
+ * header read. Known cache hits, open circuits and Fast Open origins
+ * (whose handshake rides on the first write anyway) are not speculated on.
+ */
+void speculate_origin(request_line *request)
+{
+	if (route_root || !request->hostname[0] || origin_profile.fastopen)
+		return;
+	if (strcmp(request->method, "GET") != 0)
+		return;
+	cache_line *hit = peek_cache(request->path, request->hostname);	/* the real lookup counts */
+	if (hit) {
+		int fresh = fresh_cache(hit, 0) || stale_usable(hit, 0);
+
+		release_cache(hit);
+		if (fresh)
+			return;
+	}
+	if (!origin_available(search_health(request->hostname, request->port)))
+		return;
+
+	request->connect_started = now_ms();
+	request->originfd = open_origin_start(request->hostname, request->port, &origin_profile);
+}
+
+/* client_error - send a minimal error response; failures are ignored */
+void client_error(int connfd, char *errnum, char *shortmsg, char *longmsg)
+{
+	char buf[2 * MAXLINE], body[MAXLINE];
+
+	snprintf(body, sizeof(body), "<html><title>Proxy Error</title><body>\r\n"
+		"%s: %s\r\n<p>%s\r\n</body></html>\r\n", errnum, shortmsg, longmsg);
+	snprintf(buf, sizeof(buf), "HTTP/1.0 %s %s\r\n"
+		"Content-type: text/html\r\n"
+		"Content-length: %d\r\n\r\n%s", errnum, shortmsg, (int)strlen(body), body);
+	rio_writen(connfd, buf, strlen(buf));
 }
 
 /* Header Manipulation Functions */
@@ -347,12 +1688,13 @@ void modify_header(request_line* line)
 	find = NULL;
 }
 
+/* search_header - find a request header by name; names are case-insensitive */
 request_header *search_header(request_line *request, char* type)
 {
 	request_header *temp; 
 	temp = request->root;
 	while (temp) {
-		if (strcmp(temp->name, type) == 0) return temp;
+		if (strcasecmp(temp->name, type) == 0) return temp;
 		else temp = temp->next_header;
 	}
 	return NULL;
@@ -373,85 +1715,315 @@ void insert_header(request_line *request, request_header *header)
 	}
 }
 
-/* Cache Related Functions */
-void initialize_cache() 
+/* Origin Health Functions */
+double now_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* search_health - find (or create) the health record for host:port */
+origin_health *search_health(char *hostname, char *port)
 {
-	printf("initializing cache\n");
-	cache_root = Malloc(sizeof(cache_line));
+	char key[MAXLINE];
+	unsigned long hash = 5381;
+	char *c;
+	origin_health *origin;
 
-	strcpy(cache_root->hostname, "");
-	strcpy(cache_root->path, "");
-	cache_root->size = 0;
-	cache_root->data = NULL;
-	cache_root->next_line = NULL;
-	cache_root->lru_counter = 0;
+	snprintf(key, sizeof(key), "%s:%s", hostname, port);
+	for (c = key; *c; c++)
+		hash = hash * 33 + (unsigned char)*c;
+	hash %= HEALTH_BUCKETS;
+
+	pthread_mutex_lock(&health_lock);
+	for (origin = health_table[hash]; origin; origin = origin->next_origin)
+		if (strcmp(origin->key, key) == 0)
+			break;
+	if (!origin) {
+		origin = Calloc(1, sizeof(origin_health));
+		origin->key = strdup(key);
+		origin->state = CIRCUIT_CLOSED;
+		origin->next_origin = health_table[hash];
+		health_table[hash] = origin;
+	}
+	pthread_mutex_unlock(&health_lock);
+	return origin;
 }
 
-cache_line *create_cache()
+/*
+ * advance_circuit - the timed transitions (health_lock held): a half-open
+ * trial that has had no verdict for HEALTH_PROBE_SECS reopens, so a lost
+ * probe cannot keep the origin shut, and an open circuit turns half-open
+ * once health_open_secs have passed.
+ */
+void advance_circuit(origin_health *origin)
 {
-	printf("creating a new cache item\n");
-	cache_line *temp = cache_root;
-	cache_line *new_line = Malloc(sizeof(cache_line));
+	double now = now_ms();
 
-	while (temp->next_line)
-		temp = temp->next_line;
-	temp->next_line = new_line;
-	new_line->next_line = NULL;
-	new_line->data = NULL;
-	new_line->lru_counter = 0;
-	
-	return new_line;
-} 
+	if (origin->state == CIRCUIT_HALF_OPEN && now - origin->probed_at >= HEALTH_PROBE_SECS * 1000) {
+		origin->state = CIRCUIT_OPEN;
+		origin->opened_at = now;
+	}
+	if (origin->state == CIRCUIT_OPEN && now - origin->opened_at >= health_open_secs * 1000) {
+		origin->state = CIRCUIT_HALF_OPEN;
+		origin->probed_at = now;
+		origin->probes = 0;
+		if (++origin->trial == 0)
+			origin->trial = 1;		/* 0 means no probe */
+	}
+}
 
-cache_line* search_cache(char *path, char *hostname)
+/*
+ * admit_origin - decide whether a request may go to the origin. A
+ * half-open circuit lets HEALTH_PROBES requests through; everything else
+ * is refused while it is not closed. *probe is set to the half-open trial
+ * a probe belongs to, or 0 for a request admitted while the circuit was
+ * closed.
+ */
+int admit_origin(origin_health *origin, unsigned int *probe)
 {
-	cache_line* temp = cache_root;
-	while(temp != NULL) {
-		if((strcmp(path, temp-> path) == 0) && (strcmp(hostname, temp-> hostname) == 0)) return temp;
-		temp = temp->next_line;
+	int admit = 1;
+
+	*probe = 0;
+	pthread_mutex_lock(&health_lock);
+	advance_circuit(origin);
+	if (origin->state == CIRCUIT_OPEN)
+		admit = 0;
+	else if (origin->state == CIRCUIT_HALF_OPEN) {
+		if (origin->probes < HEALTH_PROBES) {
+			origin->probes++;
+			*probe = origin->trial;
+		} else
+			admit = 0;
 	}
-	return NULL;
+	pthread_mutex_unlock(&health_lock);
+	return admit;
+}
+
+/* origin_available - whether admit_origin could let a request through now */
+int origin_available(origin_health *origin)
+{
+	int available;
+
+	pthread_mutex_lock(&health_lock);
+	advance_circuit(origin);
+	available = origin->state == CIRCUIT_CLOSED
+		|| (origin->state == CIRCUIT_HALF_OPEN && origin->probes < HEALTH_PROBES);
+	pthread_mutex_unlock(&health_lock);
+	return available;
 }
 
-void update_cache(cache_line* updated_line)
+/*
+ * report_origin - record the outcome of an admitted request, probe as
+ * admit_origin set it. A probe of the current half-open trial closes or
+ * reopens the circuit on its own; requests admitted before the circuit
+ * opened, or probes of an earlier trial, leave a half-open circuit alone.
+ * While closed, the circuit opens when the recent failure ratio reaches
+ * health_fail_ratio.
+ */
+void report_origin(origin_health *origin, unsigned int probe, int failed, double latency_ms)
 {
-	cache_line *target_line = cache_root;
-	while(target_line->next_line) {
-		target_line = target_line->next_line;
-		if (target_line != updated_line)
-			target_line->lru_counter++;
+	pthread_mutex_lock(&health_lock);
+	if (!failed)
+		origin->latency_ms = origin->latency_ms ? 0.8 * origin->latency_ms + 0.2 * latency_ms : latency_ms;
+
+	if (origin->state == CIRCUIT_HALF_OPEN) {
+		if (probe != origin->trial) {
+			pthread_mutex_unlock(&health_lock);
+			return;			/* a stale outcome */
+		}
+		origin->probes--;
+		if (failed) {
+			origin->state = CIRCUIT_OPEN;
+			origin->opened_at = now_ms();
+		} else {
+			origin->state = CIRCUIT_CLOSED;
+			origin->samples = origin->failures = origin->next = 0;
+			printf("origin %s recovered, closing circuit\n", origin->key);
+		}
+	} else if (origin->state == CIRCUIT_CLOSED) {
+		if (origin->samples == HEALTH_WINDOW)
+			origin->failures -= origin->outcome[origin->next];
 		else
-			target_line->lru_counter = 0;
+			origin->samples++;
+		origin->outcome[origin->next] = failed;
+		origin->failures += failed;
+		origin->next = (origin->next + 1) % HEALTH_WINDOW;
+
+		if (origin->samples >= HEALTH_MIN_SAMPLES
+			&& origin->failures >= health_fail_ratio * origin->samples) {
+			origin->state = CIRCUIT_OPEN;
+			origin->opened_at = now_ms();
+			printf("origin %s failing (%d/%d, %.1f ms), opening circuit\n",
+				origin->key, origin->failures, origin->samples, origin->latency_ms);
+		}
 	}
+	pthread_mutex_unlock(&health_lock);
 }
 
-void evict_cache() {
-	cache_line *temp = NULL;
-	cache_line *target = NULL;
-	int max = 0;
+/*
+ * abandon_origin - an admitted request ended without a verdict on the
+ * origin (its client went away): give its probe slot back, if it was one
+ */
+void abandon_origin(origin_health *origin, unsigned int probe)
+{
+	pthread_mutex_lock(&health_lock);
+	if (origin->state == CIRCUIT_HALF_OPEN && probe == origin->trial && origin->probes > 0)
+		origin->probes--;
+	pthread_mutex_unlock(&health_lock);
+}
+
+/* Reverse Proxy Functions */
+
+/*
+ * load_routes - read the routing table, one route per line:
+ *
+ *     <host|*> <path-prefix> <lor|p2c> <backend:port> [<backend:port> ...]
+ *
+ * Blank lines and lines starting with '#' are ignored. Routes are kept
+ * in file order; search_route picks the most specific match.
+ */
+void load_routes(char *filename)
+{
+	FILE *fp;
+	char line[MAXLINE], *tok, *save, *colon;
+	int lineno = 0;
+	route *rt, **tail = &route_root;
+
+	if (!(fp = fopen(filename, "r"))) {
+		fprintf(stderr, "cannot open routes file %s: %s\n", filename, strerror(errno));
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		lineno++;
+		if (!(tok = strtok_r(line, " \t\r\n", &save)) || tok[0] == '#')
+			continue;
+
+		rt = Calloc(1, sizeof(route));
+		rt->host = strdup(tok);
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (!tok || tok[0] != '/')
+			goto bad;
+		rt->prefix = strdup(tok);
+		rt->prefix_len = strlen(tok);
+		tok = strtok_r(NULL, " \t\r\n", &save);
+		if (tok && strcmp(tok, "lor") == 0)
+			rt->balance = BALANCE_LOR;
+		else if (tok && strcmp(tok, "p2c") == 0)
+			rt->balance = BALANCE_P2C;
+		else
+			goto bad;
 
-	temp = cache_root;
-	temp = temp->next_line;
-	target = temp;
-	max = temp->lru_counter;
-	while(temp){
-		if(temp->lru_counter > max){
-			max = temp->lru_counter;
-			target = temp;
+		while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+			backend *be = Calloc(1, sizeof(backend));
+			if (!(colon = strrchr(tok, ':')) || !colon[1])
+				goto bad;
+			*colon = '\0';
+			be->host = strdup(tok);
+			be->port = strdup(colon + 1);
+			be->health = search_health(be->host, be->port);
+			rt->backends = Realloc(rt->backends, (rt->nbackends + 1) * sizeof(backend*));
+			rt->backends[rt->nbackends++] = be;
 		}
-		temp = temp->next_line;
-	} 
-
-	temp = cache_root;
-
-	if(!target) return;
-	if(!temp) return;
-	while((temp->next_line != target) && temp)
-		temp = temp->next_line;
-	if(!temp) return;
-	temp->next_line = target ->next_line;
-	cache_size -= (target->size);
-	Free(target->data);
-	Free(target);
+		if (!rt->nbackends)
+			goto bad;
+		*tail = rt;
+		tail = &rt->next_route;
+	}
+	fclose(fp);
+	if (!route_root) {
+		fprintf(stderr, "routes file %s has no routes\n", filename);
+		exit(1);
+	}
 	return;
+bad:
+	fprintf(stderr, "%s:%d: want <host|*> <prefix> <lor|p2c> <host:port>...\n", filename, lineno);
+	exit(1);
+}
+
+/*
+ * search_route - route a request on its Host header and path. An exact
+ * host beats "*", then the longest path prefix wins. Origin-form requests
+ * get their hostname from Host so the cache key names the public site,
+ * not whichever backend served it.
+ */
+route *search_route(request_line *request)
+{
+	char host[MAXLINE], *colon;
+	request_header *hdr;
+	route *rt, *best = NULL;
+	int best_exact = 0;
+
+	if (!request->hostname[0]) {
+		if (!(hdr = search_header(request, "Host")))
+			return NULL;
+		snprintf(host, sizeof(host), "%s", hdr->data);
+		if ((colon = strchr(host, ':'))) {
+			*colon = '\0';
+			strcpy(request->port, colon + 1);
+		}
+		strcpy(request->hostname, host);
+	}
+
+	for (rt = route_root; rt; rt = rt->next_route) {
+		int exact = strcasecmp(rt->host, request->hostname) == 0;
+		if (!exact && strcmp(rt->host, "*") != 0)
+			continue;
+		if (strncmp(rt->prefix, request->path, rt->prefix_len) != 0)
+			continue;
+		if (!best || exact > best_exact
+			|| (exact == best_exact && rt->prefix_len > best->prefix_len)) {
+			best = rt;
+			best_exact = exact;
+		}
+	}
+	return best;
+}
+
+/*
+ * choose_backend - pick a backend for one request and count it as
+ * outstanding until release_backend. Backends whose circuit is open are
+ * skipped unless every backend is down.
+ */
+backend *choose_backend(route *rt)
+{
+	static __thread unsigned int seed;
+	backend *best = NULL, *be;
+	int i, n = rt->nbackends;
+
+	if (!seed)
+		seed = (unsigned int)(now_ms() * 1000) ^ (unsigned int)pthread_self();
+
+	if (rt->balance == BALANCE_P2C && n > 1) {
+		backend *a = rt->backends[rand_r(&seed) % n];
+		backend *b = rt->backends[rand_r(&seed) % n];
+		int a_up = origin_available(a->health), b_up = origin_available(b->health);
+
+		if (a_up != b_up)
+			best = a_up ? a : b;
+		else
+			best = __atomic_load_n(&a->outstanding, __ATOMIC_RELAXED)
+				<= __atomic_load_n(&b->outstanding, __ATOMIC_RELAXED) ? a : b;
+	} else {
+		int start = rand_r(&seed) % n, best_up = 0;
+
+		for (i = 0; i < n; i++) {
+			be = rt->backends[(start + i) % n];
+			int up = origin_available(be->health);
+			if (!best || up > best_up
+				|| (up == best_up && __atomic_load_n(&be->outstanding, __ATOMIC_RELAXED)
+					< __atomic_load_n(&best->outstanding, __ATOMIC_RELAXED))) {
+				best = be;
+				best_up = up;
+			}
+		}
+	}
+	__atomic_add_fetch(&best->outstanding, 1, __ATOMIC_RELAXED);
+	return best;
+}
+
+void release_backend(backend *be)
+{
+	__atomic_sub_fetch(&be->outstanding, 1, __ATOMIC_RELAXED);
 }
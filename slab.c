@@ -0,0 +1,448 @@
+/*
+ * slab.c - slab-class allocator for cached objects
+ *
+ * One arena is mapped at startup and split into SLAB_PAGE_SIZE pages.
+ * A class takes a run of free pages when its free list runs dry and cuts
+ * it into equal chunks; allocating and freeing a chunk is a free-list pop
+ * or push under one lock, whatever the object size, and the heap never
+ * sees cached objects. A run is as many pages as it takes for the chunks
+ * to fill it to within SLAB_RUN_WASTE, and a chunk is charged its share
+ * of the run, so a class just over half a page does not cost a page per
+ * chunk. Objects larger than the largest class take a span of contiguous
+ * free pages instead, and give them all back when freed. Class runs are
+ * taken from the bottom of the arena and spans from the top, so the
+ * pages classes hold do not break up the runs spans need.
+ *
+ * The arena has a run per class on top of the byte budget, so however
+ * the budget is spread over the classes each of them can hold a run and
+ * an allocation only fails when the pages are fragmented. Pages never go
+ * back to the free pages on their own. When a class runs out of chunks,
+ * or no free run is long enough, the allocation fails and the cheapest
+ * pages of other classes are drained: their free chunks are withdrawn,
+ * the owner of every used chunk is asked to drop it through the evict
+ * callback, and once the last chunk comes back through slab_free the
+ * pages are free for whichever class needs them. The caller whose
+ * allocation failed simply does not cache that object.
+ *
+ * The arena may instead be a shared mapping of a memfd, so a chunk is
+ * also a range of a file that can be handed to sendfile. The kernel
+ * keeps referring to the pages it sent, in socket buffers on either end,
+ * long after sendfile returns and even after the peer has acknowledged
+ * them, so rewriting those pages would change data still on its way.
+ * slab_file therefore only offers spans, which have their pages to
+ * themselves, and a freed span's pages are punched out of the memfd:
+ * the sockets keep the old pages and the arena gets fresh ones. Should
+ * that fail, the span's pages are written off as SLAB_LEAKED.
+ */
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#include "slab.h"
+
+#ifndef MFD_CLOEXEC					/* sys/mman.h has it only with _GNU_SOURCE */
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+static char *arena;
+static int arena_fd = -1;			/* memfd behind the arena, if any */
+static size_t npages;
+static slab_page *pages;
+static size_t free_pages;			/* pages with cls -1 */
+static size_t low_free, high_free;	/* no free page below, or above, these */
+static slab_class classes[SLAB_MAX_CLASSES];
+static int nclasses;
+static void (*evict_chunk)(void*);
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int class_of(size_t);
+static void fit_run(slab_class*);
+static slab_page *page_of(void*);
+static slab_page *find_run(size_t);
+static slab_page *find_span(size_t);
+static void carve_run(int, slab_page*);
+static void free_run(slab_page*, int);
+static int page_cost(int, size_t, size_t);
+static void rebalance(int, size_t);
+
+/*
+ * slab_init - map arena_size bytes (rounded up to whole pages) and a run
+ * per class, from a memfd if memfd is set and the kernel has them, else
+ * anonymous memory
+ */
+void slab_init(size_t arena_size, void (*evict)(void*), int memfd)
+{
+	double size = SLAB_MIN_CHUNK;
+	size_t i, reserve = 0;
+
+	for (nclasses = 0; nclasses < SLAB_MAX_CLASSES - 1
+		&& size < SLAB_CLASS_PAGES * SLAB_PAGE_SIZE; nclasses++) {
+		classes[nclasses].size = ((size_t)size + 7) & ~(size_t)7;
+		fit_run(&classes[nclasses]);
+		reserve += classes[nclasses].run;
+		size *= SLAB_GROWTH;
+	}
+	classes[nclasses].size = SLAB_CLASS_PAGES * SLAB_PAGE_SIZE;	/* the last below a span */
+	fit_run(&classes[nclasses]);
+	reserve += classes[nclasses].run;
+	nclasses++;
+	evict_chunk = evict;
+
+	npages = (arena_size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE + reserve;
+	if (memfd && (arena_fd = syscall(SYS_memfd_create, "proxy-cache", MFD_CLOEXEC)) >= 0
+		&& ftruncate(arena_fd, npages * SLAB_PAGE_SIZE) < 0) {
+		close(arena_fd);
+		arena_fd = -1;
+	}
+	if (memfd && arena_fd < 0)
+		fprintf(stderr, "slab_init: no memfd arena (%s), using anonymous memory\n", strerror(errno));
+	if (arena_fd >= 0)
+		arena = mmap(NULL, npages * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_SHARED, arena_fd, 0);
+	else
+		arena = mmap(NULL, npages * SLAB_PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (arena == MAP_FAILED)
+		unix_error("slab_init: mmap error");
+	pages = Calloc(npages, sizeof(slab_page));
+	for (i = 0; i < npages; i++)
+		pages[i].cls = -1;
+	free_pages = npages;
+	low_free = 0;
+	high_free = npages - 1;
+}
+
+/* slab_alloc - a chunk of at least size bytes, or NULL if none is free */
+void *slab_alloc(size_t size)
+{
+	int cls = class_of(size);
+	slab_class *c;
+	slab_page *page;
+	void *chunk = NULL;
+	size_t span, i;
+
+	if (cls < 0) {
+		span = (size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE;
+		if (span > npages)
+			return NULL;
+		pthread_mutex_lock(&slab_lock);
+		if ((page = find_span(span))) {
+			for (i = 0; i < span; i++) {
+				page[i].cls = SLAB_SPAN;
+				page[i].first = page;
+			}
+			page->span = span;
+			page->used = 1;
+			free_pages -= span;
+			chunk = arena + (page - pages) * SLAB_PAGE_SIZE;
+		}
+		pthread_mutex_unlock(&slab_lock);
+
+		if (!chunk)
+			rebalance(-1, span);
+		return chunk;
+	}
+	c = &classes[cls];
+
+	pthread_mutex_lock(&slab_lock);
+	if (!c->free_chunks && (page = find_run(c->run)))
+		carve_run(cls, page);
+	if ((chunk = c->free_chunks)) {
+		c->free_chunks = *(void**)chunk;
+		c->nfree--;
+		page_of(chunk)->first->used++;
+	} else
+		c->failures++;
+	pthread_mutex_unlock(&slab_lock);
+
+	if (!chunk)
+		rebalance(cls, c->run);
+	return chunk;
+}
+
+void slab_free(void *chunk)
+{
+	slab_page *page = page_of(chunk)->first;
+	slab_class *c;
+	int i;
+
+	if (page->cls == SLAB_SPAN && arena_fd >= 0
+		&& syscall(SYS_fallocate, arena_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			(off_t)((char*)chunk - arena), (off_t)page->span * SLAB_PAGE_SIZE) < 0) {
+		pthread_mutex_lock(&slab_lock);		/* cannot detach the pages: never reuse them */
+		for (i = 0; i < page->span; i++)
+			page[i].cls = SLAB_LEAKED;
+		pthread_mutex_unlock(&slab_lock);
+		return;
+	}
+
+	pthread_mutex_lock(&slab_lock);
+	if (page->cls == SLAB_SPAN) {
+		free_run(page, page->span);
+		pthread_mutex_unlock(&slab_lock);
+		return;
+	}
+	c = &classes[page->cls];
+	page->used--;
+	if (!page->draining) {
+		*(void**)chunk = c->free_chunks;
+		c->free_chunks = chunk;
+		c->nfree++;
+	} else if (page->used == 0) {
+		c->pages -= c->run;
+		free_run(page, c->run);
+	}
+	pthread_mutex_unlock(&slab_lock);
+}
+
+/*
+ * slab_chunk_size - the arena a chunk takes up: its share of its run, the
+ * part no chunk fits in included, or its span. Charging this keeps a
+ * byte budget from using more pages than the arena has.
+ */
+size_t slab_chunk_size(void *chunk)
+{
+	slab_page *page = page_of(chunk)->first;
+
+	if (page->cls == SLAB_SPAN)
+		return page->span * SLAB_PAGE_SIZE;
+	return classes[page->cls].run * SLAB_PAGE_SIZE / classes[page->cls].perrun;
+}
+
+/*
+ * slab_file - the memfd behind the arena and, in *offset, where ptr (any
+ * byte inside a chunk) lies in it; -1 if the arena is anonymous memory
+ * or the chunk shares its pages, which must then not be sent by reference
+ */
+int slab_file(void *ptr, off_t *offset)
+{
+	if (arena_fd < 0 || page_of(ptr)->cls != SLAB_SPAN)
+		return -1;
+	*offset = (char*)ptr - arena;
+	return arena_fd;
+}
+
+static int class_of(size_t size)
+{
+	int cls;
+
+	for (cls = 0; cls < nclasses; cls++)
+		if (classes[cls].size >= size)
+			return cls;
+	return -1;
+}
+
+/*
+ * fit_run - the shortest run, of at least one chunk, that the chunks of
+ * class c fill to within SLAB_RUN_WASTE; failing that up to SLAB_MAX_RUN
+ * pages, the one they fill best
+ */
+static void fit_run(slab_class *c)
+{
+	size_t run, bytes, waste, best_waste = 0;
+
+	c->run = 0;
+	for (run = (c->size + SLAB_PAGE_SIZE - 1) / SLAB_PAGE_SIZE; run <= SLAB_MAX_RUN; run++) {
+		bytes = run * SLAB_PAGE_SIZE;
+		waste = bytes % c->size;
+		if (!c->run || waste * c->run * SLAB_PAGE_SIZE < best_waste * bytes) {
+			c->run = run;
+			best_waste = waste;
+		}
+		if (waste * SLAB_RUN_WASTE <= bytes)
+			break;
+	}
+	c->perrun = c->run * SLAB_PAGE_SIZE / c->size;
+}
+
+static slab_page *page_of(void *chunk)
+{
+	return &pages[((char*)chunk - arena) / SLAB_PAGE_SIZE];
+}
+
+/* find_run - the lowest run of run free pages, or NULL (slab_lock held) */
+static slab_page *find_run(size_t run)
+{
+	size_t i, found = 0, bottom = npages;
+
+	if (free_pages < run)
+		return NULL;
+	for (i = low_free; i < npages; i++) {
+		if (pages[i].cls != -1)
+			found = 0;
+		else if (++found == 1 && bottom == npages)
+			bottom = i;
+		if (found == run)
+			break;
+	}
+	low_free = bottom;				/* the first free page on the way up */
+	return found == run ? &pages[i + 1 - run] : NULL;
+}
+
+/* find_span - the highest run of span free pages, or NULL (slab_lock held) */
+static slab_page *find_span(size_t span)
+{
+	size_t i, run = 0, top = npages;
+
+	if (!free_pages)
+		return NULL;
+	for (i = high_free + 1; i-- > 0; ) {
+		if (pages[i].cls != -1)
+			run = 0;
+		else if (++run == 1 && top == npages)
+			top = i;
+		if (run == span)
+			break;
+	}
+	high_free = top < npages ? top : 0;	/* the first free page on the way down */
+	return run == span ? &pages[i] : NULL;
+}
+
+/* carve_run - give the free run at page to class cls (slab_lock held) */
+static void carve_run(int cls, slab_page *page)
+{
+	slab_class *c = &classes[cls];
+	char *base = arena + (page - pages) * SLAB_PAGE_SIZE;
+	int i;
+
+	for (i = 0; i < c->run; i++) {
+		page[i].cls = cls;
+		page[i].first = page;
+	}
+	page->span = c->run;
+	page->used = 0;
+	page->draining = 0;
+	for (i = c->perrun - 1; i >= 0; i--) {
+		*(void**)(base + i * c->size) = c->free_chunks;
+		c->free_chunks = base + i * c->size;
+	}
+	c->nfree += c->perrun;
+	c->pages += c->run;
+	free_pages -= c->run;
+}
+
+/* free_run - return n pages from page on to the free pages (slab_lock held) */
+static void free_run(slab_page *page, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		page[i].cls = -1;
+		page[i].used = 0;
+		page[i].draining = 0;
+		page[i].span = 0;
+		page[i].first = NULL;
+	}
+	free_pages += n;
+	if ((size_t)(page - pages) < low_free)
+		low_free = page - pages;
+	if ((size_t)(page + n - 1 - pages) > high_free)
+		high_free = page + n - 1 - pages;
+}
+
+/*
+ * page_cost - chunks to evict so that page i comes free for class cls,
+ * counting a run or span once, at the first page of the window it is
+ * seen in; -1 if it never will (slab_lock held). A draining run costs
+ * what it still holds, so a window waiting on slow readers does not
+ * look free.
+ */
+static int page_cost(int cls, size_t i, size_t start)
+{
+	slab_page *page = &pages[i];
+
+	if (page->cls == -1)
+		return 0;
+	if (page->cls == SLAB_LEAKED || (cls >= 0 && page->cls == cls))
+		return -1;
+	if (page->first != page && i != start)
+		return 0;
+	return page->first->used;
+}
+
+/*
+ * rebalance - class cls (-1 for a span) starved: drain the window of span
+ * pages that costs the fewest evictions so it can be handed over. A class
+ * never drains its own pages. The window slides over the arena once,
+ * keeping the cost of its pages as seen from no window in particular and
+ * correcting for the run it may start in the middle of. Evictions run
+ * without slab_lock because the callback takes cache locks and ends in
+ * slab_free.
+ */
+static void rebalance(int cls, size_t span)
+{
+	size_t i, start, blocked, best = 0, n = 0;
+	long cost, each, window, best_cost = -1;
+	void **victims, **link;
+	slab_page *first;
+
+	pthread_mutex_lock(&slab_lock);
+	if ((cls >= 0 ? find_run(span) : find_span(span)) != NULL) {
+		pthread_mutex_unlock(&slab_lock);	/* pages came free meanwhile */
+		return;
+	}
+	for (i = 0, cost = 0, blocked = 0; i < npages; i++) {
+		each = page_cost(cls, i, npages);
+		blocked += each < 0;
+		cost += each < 0 ? 0 : each;
+		if (i >= span) {
+			each = page_cost(cls, i - span, npages);
+			blocked -= each < 0;
+			cost -= each < 0 ? 0 : each;
+		}
+		if (i + 1 < span || blocked)
+			continue;
+		start = i + 1 - span;
+		window = cost - page_cost(cls, start, npages) + page_cost(cls, start, start);
+		if (best_cost < 0 || window < best_cost) {
+			best = start;
+			best_cost = window;
+		}
+	}
+	if (best_cost < 0) {
+		pthread_mutex_unlock(&slab_lock);
+		return;
+	}
+
+	/* withdraw the runs' free chunks; whatever is left is in use */
+	victims = Malloc((best_cost + 1) * sizeof(void*));
+	for (i = best; i < best + span; i++) {
+		if (pages[i].cls == -1 || pages[i].first->draining)
+			continue;
+		first = pages[i].first;
+		if (first->cls == SLAB_SPAN) {
+			first->draining = 1;
+			victims[n++] = arena + (first - pages) * SLAB_PAGE_SIZE;
+			continue;
+		}
+
+		slab_class *c = &classes[first->cls];
+		char *base = arena + (first - pages) * SLAB_PAGE_SIZE;
+		char *used = Malloc(c->perrun);
+		int j;
+
+		memset(used, 1, c->perrun);
+		for (link = &c->free_chunks; *link; ) {
+			char *chunk = *link;
+			if (chunk >= base && chunk < base + c->run * SLAB_PAGE_SIZE) {
+				used[(chunk - base) / c->size] = 0;
+				*link = *(void**)chunk;
+				c->nfree--;
+			} else
+				link = (void**)chunk;
+		}
+		if (first->used == 0) {
+			c->pages -= c->run;
+			free_run(first, c->run);
+		} else {
+			first->draining = 1;
+			for (j = 0; j < c->perrun; j++)
+				if (used[j])
+					victims[n++] = base + j * c->size;
+		}
+		Free(used);
+	}
+	pthread_mutex_unlock(&slab_lock);
+
+	for (i = 0; i < n; i++)
+		evict_chunk(victims[i]);
+	Free(victims);
+}
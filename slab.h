@@ -0,0 +1,55 @@
+/*
+ * slab.h - slab-class allocator for cached objects
+ */
+#ifndef __SLAB_H__
+#define __SLAB_H__
+
+#include "csapp.h"
+
+/*
+ * Chunks come in size classes growing by SLAB_GROWTH from SLAB_MIN_CHUNK
+ * up to SLAB_CLASS_PAGES pages; larger objects get a span of whole pages
+ * to themselves. Pages are carved from one arena mapped at startup and
+ * handed to classes on demand, so the arena size is a hard bound. Pages
+ * are kept small next to the arena so that every class can have some.
+ * A class takes a run of up to SLAB_MAX_RUN pages at a time, the shortest
+ * one its chunks fill to within SLAB_RUN_WASTE, so chunks may straddle
+ * pages.
+ */
+#define SLAB_PAGE_SIZE (4 * 1024)
+#define SLAB_MIN_CHUNK 64
+#define SLAB_GROWTH 1.25
+#define SLAB_MAX_CLASSES 64
+#define SLAB_CLASS_PAGES 4				/* the largest class */
+#define SLAB_MAX_RUN 8
+#define SLAB_RUN_WASTE 8				/* at most 1/8 of a run left over */
+#define SLAB_SPAN (-2)					/* slab_page.cls of a page in a span */
+#define SLAB_LEAKED (-3)				/* of a freed span the memfd would not let go */
+
+typedef struct slab_page
+{
+	int cls;						/* owning class, -1 while free, SLAB_SPAN or SLAB_LEAKED */
+	int used;						/* chunks handed out, on the run's first page */
+	int draining;					/* being emptied for another class, likewise */
+	int span;						/* pages in the run or span, on its first page */
+	struct slab_page *first;		/* the run's or span's first page */
+} slab_page;
+
+typedef struct slab_class
+{
+	size_t size;					/* chunk size */
+	int run;						/* pages taken at a time */
+	int perrun;						/* chunks in a run */
+	void *free_chunks;				/* chunks link through their first word */
+	size_t nfree;
+	int pages;
+	unsigned long failures;			/* allocations that found no chunk */
+} slab_class;
+
+void slab_init(size_t, void (*)(void*), int);
+void *slab_alloc(size_t);
+void slab_free(void*);
+size_t slab_chunk_size(void*);
+int slab_file(void*, off_t*);
+
+#endif /* __SLAB_H__ */